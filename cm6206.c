@@ -0,0 +1,2215 @@
+// SPDX-License-Identifier: GPL-2.0+
+//
+// libcm6206: Library to control registers of a CM6206 based USB sound card
+// Copyright (C) 2019 Tommy Vestermark (tovsurf@vestermark.dk)
+//
+// Dependencies:
+// - libhidapi-dev
+// - libusb-1.0-0-dev (optional, build with -DCM6206_WITH_LIBUSB)
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <linux/hidraw.h>
+#include <hidapi/hidapi.h>
+#ifdef CM6206_WITH_LIBUSB
+#include <libusb-1.0/libusb.h>
+#endif
+#include "cm6206.h"
+
+//////// Global constants
+
+#define PIPELINE_DRAIN_MS   20      // Time to wait for stray responses after a failed pipelined read
+#define LOOP_MAX_EVENTS     16      // Descriptor events handled per wait of the event loop
+
+// Backend used when none is given. Can be changed at build time (e.g. -DCM6206_DEFAULT_BACKEND=\"hidraw\")
+#ifndef CM6206_DEFAULT_BACKEND
+#define CM6206_DEFAULT_BACKEND  "hidapi"
+#endif
+
+const uint16_t cm6206_reg_default[CM6206_NUM_REGS] = {
+    0x2000,
+    0x3002,
+    0x6004,
+    0x147f,
+    0x0000,
+    0x3000
+};
+
+const cm6206_setting cm6206_profile_init[] = {
+    {0, 0xFFFF, 0x2004},    // Do not assert copyright
+    {1, 0xFFFF, 0x3000},    // Enable SPDIF Out
+    {2, 0xFFFF, 0xF800},    // Enable drivers. Mute Headphone. Disable BTL
+    {3, 0xFFFF, 0x147f},
+    {4, 0xFFFF, 0x0000},
+    {5, 0xFFFF, 0x3000}
+};
+const unsigned cm6206_profile_init_count = sizeof(cm6206_profile_init)/sizeof(cm6206_profile_init[0]);
+
+// Queued asynchronous request
+struct async_request {
+    cm6206_callback callback;
+    void        *user;
+    int64_t     startNs;            // First dispatch of request (monotonic clock)
+    int64_t     deadlineMs;         // Deadline of response to read in flight
+    uint16_t    value;              // Value to write
+    uint8_t     regnum;
+    bool        write;
+    int         attempt;            // Number of resent read requests
+    bool        dropped;            // A late response was dropped while waiting for this attempt
+};
+
+// Device context. Only accessed by the thread using the context
+struct cm6206_ctx {
+    const cm6206_transport *transport;  // NULL = no device (shadow registers only)
+    void        *handle;            // Handle of transport
+    uint16_t    regs[CM6206_NUM_REGS];  // Shadow registers
+    unsigned    valid;              // Bitmask of shadow registers which are in sync with device
+    int         timeoutMs;          // I/O deadline (0 = wait forever)
+    int         retries;            // Number of retries of a timed out register read
+    bool        pipeline;           // Queue register read requests before collecting responses
+    bool        pipelineFailed;     // Pipelined reads failed once. Use lockstep reads only
+    unsigned    lateResponses;      // Responses owed to timed out read requests. Dropped when they arrive
+    int64_t     drainUntilMs;       // No async request is sent before, so that late responses are dropped
+    void        (*asyncHandler)(void *user, const uint8_t *report, int len);
+    void        *asyncUser;
+    void        (*writeHook)(void *user, unsigned reg, uint16_t value);
+    void        *writeUser;
+    void        (*ioGuard)(void *user, int timeoutMs);
+    void        *guardUser;
+    uint16_t    pendingMask[CM6206_NUM_REGS];   // Queued settings (see cm6206_queue)
+    uint16_t    pendingValue[CM6206_NUM_REGS];
+    unsigned    pendingForce;       // Registers written on commit even if unchanged
+    cm6206_stats stats;
+    cm6206_trace_entry trace[CM6206_TRACE_SIZE];    // Ring of last transfers
+    unsigned    traceHead;          // Next entry to write
+    unsigned    traceCount;
+    cm6206_loop *loop;              // Event loop of asynchronous requests (NULL = not added)
+    int         pollFd;             // Descriptor of transport watched by loop (-1 = device failed)
+    struct async_request async[CM6206_ASYNC_DEPTH];     // Ring of outstanding requests
+    unsigned    asyncHead;          // Oldest request
+    unsigned    asyncCount;
+    bool        asyncInFlight;      // Read request of oldest request has been sent
+    char        errmsg[256];        // Text of last error
+    char        ioerr[128];         // Text of last transport error
+};
+
+// Milliseconds from monotonic clock
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Nanoseconds from monotonic clock
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Set text of last error. Returns error code
+__attribute__((format(printf, 3, 4)))
+static int set_error(cm6206_ctx *ctx, int error, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(ctx->errmsg, sizeof(ctx->errmsg), fmt, ap);
+    va_end(ap);
+    return error;
+}
+
+const char *cm6206_strerror(int error) {
+    switch(error) {
+        case 0:                     return "Success";
+        case CM6206_ERR_WRITE:      return "Output report could not be written";
+        case CM6206_ERR_READ:       return "Input report could not be read";
+        case CM6206_ERR_REPORT:     return "No register data in the input report";
+        case CM6206_ERR_TIMEOUT:    return "No response within deadline";
+        case CM6206_ERR_OPEN:       return "Device could not be opened";
+        case CM6206_ERR_NODEV:      return "No device";
+        case CM6206_ERR_PARAM:      return "Invalid parameter";
+        case CM6206_ERR_NOMEM:      return "Out of memory";
+        case CM6206_ERR_FIELD:      return "Unknown field";
+        case CM6206_ERR_VALUE:      return "Invalid field value";
+        case CM6206_ERR_AMBIGUOUS:  return "Field setting is ambiguous";
+        case CM6206_ERR_BACKEND:    return "Backend not available";
+        case CM6206_ERR_BUSY:       return "Device busy with outstanding requests";
+        default:                    return "Unknown error";
+    }
+}
+
+
+//////// Transport: hidapi
+
+// hidapi initialization and opening of devices is not thread safe
+static pthread_once_t hidInitOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hid_init_once(void) {
+    hid_init();
+}
+
+// Open device by hidapi path (NULL = first device found)
+static int hidapi_open(const char *path, void **handle) {
+    pthread_once(&hidInitOnce, hid_init_once);
+    pthread_mutex_lock(&openLock);
+    if(path) {
+        *handle = hid_open_path(path);
+    } else {
+        *handle = hid_open(CM6206_VENDOR_ID, CM6206_PRODUCT_ID, NULL);
+    }
+    pthread_mutex_unlock(&openLock);
+    return *handle ? 0 : CM6206_ERR_OPEN;
+}
+
+static int hidapi_write(void *handle, const uint8_t *report, size_t len) {
+    return hid_write(handle, report, len);
+}
+
+static int hidapi_read(void *handle, uint8_t *buf, size_t size, int timeoutMs) {
+    return hid_read_timeout(handle, buf, size, timeoutMs);
+}
+
+static void hidapi_error(void *handle, char *buf, size_t size) {
+    const wchar_t *msg = hid_error(handle);
+    if(msg)     snprintf(buf, size, "%ls", msg);
+}
+
+static int hidapi_get_strings(void *handle, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len) {
+    if(manuf)       hid_get_manufacturer_string(handle, manuf, len);
+    if(product)     hid_get_product_string(handle, product, len);
+    if(serial)      hid_get_serial_number_string(handle, serial, len);
+    return 0;
+}
+
+static void hidapi_close(void *handle) {
+    pthread_mutex_lock(&openLock);
+    hid_close(handle);
+    pthread_mutex_unlock(&openLock);
+}
+
+static const cm6206_transport hidapi_transport = {
+    "hidapi", hidapi_write, hidapi_read, hidapi_error, hidapi_get_strings, hidapi_close, NULL
+};
+
+
+//////// Transport: hidraw
+// Talks to the kernel HID driver through /dev/hidrawN with plain read/write/poll. The kernel keeps
+// ownership of the device, so other programs can use it at the same time. Input reports are passed
+// to every reader, so concurrent register reads of several programs can still mix up responses.
+// Report IDs are handled as with hidapi: output reports start with ID 0, which the kernel strips.
+
+#define SYSFS_HIDRAW    "/sys/class/hidraw"
+
+struct hidraw_device {
+    int     fd;
+    int     error;          // errno of last failed transfer
+};
+
+// Read sysfs attribute into string without trailing newline. Returns 0 on success
+static int read_sysfs(const char *path, char *buf, size_t size) {
+    FILE *file = fopen(path, "r");
+    if(!file)   return -1;
+    if(!fgets(buf, size, file))     buf[0] = '\0';
+    fclose(file);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// Read numeric attribute of sysfs directory relative to hidraw node
+static long hidraw_attr(const char *node, const char *attr, int base) {
+    char path[256], str[32];
+    snprintf(path, sizeof(path), "%s/%s/device/%s", SYSFS_HIDRAW, node, attr);
+    if(read_sysfs(path, str, sizeof(str)) < 0)  return -1;
+    return strtol(str, NULL, base);
+}
+
+// Find hidraw node of device with hidapi-libusb style path "<bus>:<address>:<interface>"
+// (NULL = first CM6206). The hidraw device is a child of the USB interface
+static int hidraw_find(const char *path, char *devnode, size_t size) {
+    unsigned bus = 0, addr = 0, iface = 0;
+    if(path && sscanf(path, "%x:%x:%x", &bus, &addr, &iface) != 3)  return CM6206_ERR_PARAM;
+    DIR *dir = opendir(SYSFS_HIDRAW);
+    if(!dir)    return CM6206_ERR_OPEN;
+    struct dirent *de;
+    int res = CM6206_ERR_OPEN;
+    while(res < 0 && (de = readdir(dir))) {
+        if(de->d_name[0] == '.')    continue;
+        if(hidraw_attr(de->d_name, "../../idVendor", 16) != CM6206_VENDOR_ID
+        || hidraw_attr(de->d_name, "../../idProduct", 16) != CM6206_PRODUCT_ID)     continue;
+        if(path && (hidraw_attr(de->d_name, "../../busnum", 10) != bus
+                 || hidraw_attr(de->d_name, "../../devnum", 10) != addr
+                 || hidraw_attr(de->d_name, "../bInterfaceNumber", 16) != iface))   continue;
+        if(snprintf(devnode, size, "/dev/%s", de->d_name) >= (int)size)    continue;  // Name does not fit
+        res = 0;
+    }
+    closedir(dir);
+    if(res < 0)     errno = ENODEV;
+    return res;
+}
+
+// Open device by hidraw node (e.g. "/dev/hidraw2") or hidapi-libusb style path (NULL = first device found)
+static int hidraw_open(const char *path, void **handle) {
+    char devnode[64];
+    if(!path || path[0] != '/') {
+        int res = hidraw_find(path, devnode, sizeof(devnode));
+        if(res < 0)     return res;
+        path = devnode;
+    }
+    struct hidraw_device *h = calloc(1, sizeof(*h));
+    if(!h)      return CM6206_ERR_NOMEM;
+    h->fd = open(path, O_RDWR | O_CLOEXEC);
+    if(h->fd < 0) {
+        free(h);
+        return CM6206_ERR_OPEN;
+    }
+    struct hidraw_devinfo info;
+    if(ioctl(h->fd, HIDIOCGRAWINFO, &info) < 0
+    || (uint16_t)info.vendor != CM6206_VENDOR_ID || (uint16_t)info.product != CM6206_PRODUCT_ID) {
+        close(h->fd);
+        free(h);
+        errno = ENODEV;     // Not a CM6206
+        return CM6206_ERR_OPEN;
+    }
+    *handle = h;
+    return 0;
+}
+
+static int hidraw_write(void *handle, const uint8_t *report, size_t len) {
+    struct hidraw_device *h = handle;
+    ssize_t res;
+    while((res = write(h->fd, report, len)) < 0 && errno == EINTR) {}
+    if(res < 0)     h->error = errno;
+    return res;
+}
+
+static int hidraw_read(void *handle, uint8_t *buf, size_t size, int timeoutMs) {
+    struct hidraw_device *h = handle;
+    struct pollfd pfd = {h->fd, POLLIN, 0};
+    int64_t deadline = monotonic_ms() + timeoutMs;
+    int res;
+    while((res = poll(&pfd, 1, timeoutMs)) < 0 && errno == EINTR) {    // Signal. Wait for the remaining time
+        if(timeoutMs < 0)   continue;
+        int64_t remaining = deadline - monotonic_ms();
+        timeoutMs = (remaining > 0) ? (int)remaining : 0;
+    }
+    if(res > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        errno = ENODEV;     // Device removed
+        res = -1;
+    }
+    if(res > 0)     res = read(h->fd, buf, size);
+    if(res < 0)     h->error = errno;
+    return res;
+}
+
+static void hidraw_error(void *handle, char *buf, size_t size) {
+    struct hidraw_device *h = handle;
+    if(h->error)    snprintf(buf, size, "%s", strerror(h->error));
+}
+
+// Strings are read from the attributes of the USB device in sysfs
+static int hidraw_get_strings(void *handle, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len) {
+    struct hidraw_device *h = handle;
+    struct stat st;
+    if(fstat(h->fd, &st) < 0)   return CM6206_ERR_READ;
+    static const char *const attrs[3] = {"manufacturer", "product", "serial"};
+    wchar_t *const strs[3] = {manuf, product, serial};
+    for(int n=0; n<3; n++) {
+        char path[128], str[128] = "";
+        if(!strs[n])    continue;
+        snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/../../%s", major(st.st_rdev), minor(st.st_rdev), attrs[n]);
+        read_sysfs(path, str, sizeof(str));
+        swprintf(strs[n], len, L"%s", str);
+    }
+    return 0;
+}
+
+static void hidraw_close(void *handle) {
+    struct hidraw_device *h = handle;
+    close(h->fd);
+    free(h);
+}
+
+static int hidraw_poll_fd(void *handle) {
+    struct hidraw_device *h = handle;
+    return h->fd;
+}
+
+static const cm6206_transport hidraw_transport = {
+    "hidraw", hidraw_write, hidraw_read, hidraw_error, hidraw_get_strings, hidraw_close, hidraw_poll_fd
+};
+
+
+#ifdef CM6206_WITH_LIBUSB
+//////// Transport: libusb
+// Talks to the HID interface with synchronous transfers on the caller's thread. Output reports are
+// sent as SET_REPORT control transfers and input reports are read from the interrupt IN endpoint,
+// so there is no background thread and no report queue as with hidapi-libusb.
+// Input reports are only fetched while a read is pending. The device keeps one report until it is
+// polled, so a pipelined read may lose responses and fall back to lockstep.
+
+#define LIBUSB_INTERFACE        3       // HID interface of CM6206
+#define LIBUSB_WRITE_TIMEOUT_MS CM6206_DEFAULT_TIMEOUT_MS
+
+struct usbdev {
+    libusb_context          *usb;       // Separate libusb context per device
+    libusb_device_handle    *dev;
+    int                     iface;
+    uint8_t                 epIn;       // Interrupt IN endpoint
+    int                     error;      // Last libusb error
+};
+
+// Find interrupt IN endpoint of interface. Returns 0 if not found
+static uint8_t usbdev_find_endpoint(libusb_device *device, int iface) {
+    struct libusb_config_descriptor *config;
+    uint8_t ep = 0;
+    if(libusb_get_active_config_descriptor(device, &config) < 0)    return 0;
+    for(int i = 0; i < config->bNumInterfaces && !ep; i++) {
+        const struct libusb_interface_descriptor *alt = &config->interface[i].altsetting[0];
+        if(config->interface[i].num_altsetting < 1 || alt->bInterfaceNumber != iface)   continue;
+        for(int e = 0; e < alt->bNumEndpoints; e++) {
+            const struct libusb_endpoint_descriptor *d = &alt->endpoint[e];
+            if((d->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+            && (d->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+                ep = d->bEndpointAddress;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return ep;
+}
+
+// Open device by hidapi-libusb style path "<bus>:<address>:<interface>" (NULL = first device found)
+static int usbdev_open(const char *path, void **handle) {
+    unsigned bus = 0, addr = 0, iface = LIBUSB_INTERFACE;
+    if(path && sscanf(path, "%x:%x:%x", &bus, &addr, &iface) != 3)  return CM6206_ERR_PARAM;
+    struct usbdev *u = calloc(1, sizeof(*u));
+    if(!u)      return CM6206_ERR_NOMEM;
+    if(libusb_init(&u->usb) < 0) {
+        free(u);
+        return CM6206_ERR_OPEN;
+    }
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(u->usb, &list);
+    for(ssize_t i = 0; i < n && !u->dev; i++) {
+        struct libusb_device_descriptor desc;
+        if(libusb_get_device_descriptor(list[i], &desc) < 0
+        || desc.idVendor != CM6206_VENDOR_ID || desc.idProduct != CM6206_PRODUCT_ID)    continue;
+        if(path && (libusb_get_bus_number(list[i]) != bus || libusb_get_device_address(list[i]) != addr))   continue;
+        u->epIn = usbdev_find_endpoint(list[i], iface);
+        if(u->epIn && libusb_open(list[i], &u->dev) < 0)    u->dev = NULL;
+    }
+    if(n >= 0)  libusb_free_device_list(list, 1);
+    u->iface = iface;
+    if(!u->dev) {
+        libusb_exit(u->usb);
+        free(u);
+        return CM6206_ERR_OPEN;
+    }
+    libusb_set_auto_detach_kernel_driver(u->dev, 1);    // usbhid is reattached on release
+    if(libusb_claim_interface(u->dev, u->iface) < 0) {
+        libusb_close(u->dev);
+        libusb_exit(u->usb);
+        free(u);
+        return CM6206_ERR_OPEN;
+    }
+    *handle = u;
+    return 0;
+}
+
+// Output report is sent without report ID (0) by SET_REPORT (Output)
+static int usbdev_write(void *handle, const uint8_t *report, size_t len) {
+    struct usbdev *u = handle;
+    if(len < 1)     return -1;
+    int res = libusb_control_transfer(u->dev,
+        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+        0x09,                   // SET_REPORT
+        (2 << 8) | report[0],   // Report type Output, report ID
+        u->iface, (uint8_t *)report + 1, len - 1, LIBUSB_WRITE_TIMEOUT_MS);
+    if(res < 0) {
+        u->error = res;
+        return -1;
+    }
+    return res + 1;
+}
+
+static int usbdev_read(void *handle, uint8_t *buf, size_t size, int timeoutMs) {
+    struct usbdev *u = handle;
+    int transferred = 0;
+    // libusb timeout 0 means forever. A poll (0) waits for one frame instead
+    unsigned timeout = (timeoutMs < 0) ? 0 : (timeoutMs == 0 ? 1 : timeoutMs);
+    int res = libusb_interrupt_transfer(u->dev, u->epIn, buf, size, &transferred, timeout);
+    if(res == LIBUSB_ERROR_TIMEOUT)     return transferred;
+    if(res < 0) {
+        u->error = res;
+        return -1;
+    }
+    return transferred;
+}
+
+static void usbdev_error(void *handle, char *buf, size_t size) {
+    struct usbdev *u = handle;
+    if(u->error)    snprintf(buf, size, "%s", libusb_strerror(u->error));
+}
+
+static void usbdev_get_string(struct usbdev *u, uint8_t index, wchar_t *str, size_t len) {
+    unsigned char ascii[128] = "";
+    if(index)   libusb_get_string_descriptor_ascii(u->dev, index, ascii, sizeof(ascii));
+    swprintf(str, len, L"%s", (char *)ascii);
+}
+
+static int usbdev_get_strings(void *handle, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len) {
+    struct usbdev *u = handle;
+    struct libusb_device_descriptor desc;
+    if(libusb_get_device_descriptor(libusb_get_device(u->dev), &desc) < 0)  return CM6206_ERR_READ;
+    if(manuf)       usbdev_get_string(u, desc.iManufacturer, manuf, len);
+    if(product)     usbdev_get_string(u, desc.iProduct, product, len);
+    if(serial)      usbdev_get_string(u, desc.iSerialNumber, serial, len);
+    return 0;
+}
+
+static void usbdev_close(void *handle) {
+    struct usbdev *u = handle;
+    libusb_release_interface(u->dev, u->iface);
+    libusb_close(u->dev);
+    libusb_exit(u->usb);
+    free(u);
+}
+
+static const cm6206_transport usbdev_transport = {
+    "libusb", usbdev_write, usbdev_read, usbdev_error, usbdev_get_strings, usbdev_close, NULL
+};
+#endif // CM6206_WITH_LIBUSB
+
+
+//////// Transport: emulated CM6206
+// In-process emulation of the register protocol for tests and benchmarks without hardware.
+// Registers start in reset state. Responses are queued and delivered after the configured latency.
+// Parameters (all optional): "latency=<us>,jitter=<us>,drop=<%>,error=<%>,stall=<%>,stallus=<us>,seed=<n>"
+// For the event loop a timerfd is armed for the time of the next response.
+
+#define EMU_QUEUE_SIZE  64      // Max number of responses in flight
+
+struct emu_response {
+    int64_t     readyNs;        // Time when response is delivered (monotonic clock)
+    uint8_t     data[3];
+};
+
+struct emu_device {
+    uint16_t    regs[CM6206_NUM_REGS];
+    unsigned    latencyUs;      // Time from read request to response, and duration of a write
+    unsigned    jitterUs;       // Random additional latency (uniform)
+    unsigned    dropPct;        // Percentage of read requests which get no response
+    unsigned    errorPct;       // Percentage of transfers which fail
+    unsigned    stallPct;       // Percentage of responses which are delayed by stallUs
+    unsigned    stallUs;
+    uint64_t    rng;            // State of random generator (xorshift64)
+    struct emu_response queue[EMU_QUEUE_SIZE];
+    unsigned    head, count;
+    int         timerfd;        // Readable when next response is ready (-1 = not polled)
+    const char  *error;         // Text of last error
+};
+
+static void sleep_ns(int64_t ns) {
+    if(ns <= 0)     return;
+    struct timespec ts = {ns/1000000000, ns%1000000000};
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+static unsigned emu_random(struct emu_device *emu, unsigned range) {
+    emu->rng ^= emu->rng << 13;
+    emu->rng ^= emu->rng >> 7;
+    emu->rng ^= emu->rng << 17;
+    return range ? (unsigned)(emu->rng % range) : 0;
+}
+
+// Does random event with percentage happen
+static bool emu_chance(struct emu_device *emu, unsigned pct) {
+    return pct && emu_random(emu, 100) < pct;
+}
+
+// Latency of a transfer in ns
+static int64_t emu_latency(struct emu_device *emu) {
+    int64_t us = emu->latencyUs + emu_random(emu, emu->jitterUs + 1);
+    if(emu_chance(emu, emu->stallPct))  us += emu->stallUs;
+    return us * 1000;
+}
+
+static int emu_open(const char *params, void **handle) {
+    struct emu_device *emu = calloc(1, sizeof(*emu));
+    if(!emu)    return CM6206_ERR_NOMEM;
+    memcpy(emu->regs, cm6206_reg_default, sizeof(emu->regs));
+    emu->rng = 1;
+    emu->timerfd = -1;
+    while(params && *params) {
+        char key[16];
+        unsigned long val;
+        int len;
+        if(sscanf(params, "%15[a-z]=%lu%n", key, &val, &len) != 2) {
+            free(emu);
+            return CM6206_ERR_PARAM;
+        }
+        if(strcmp(key, "latency") == 0)         emu->latencyUs = val;
+        else if(strcmp(key, "jitter") == 0)     emu->jitterUs = val;
+        else if(strcmp(key, "drop") == 0)       emu->dropPct = val;
+        else if(strcmp(key, "error") == 0)      emu->errorPct = val;
+        else if(strcmp(key, "stall") == 0)      emu->stallPct = val;
+        else if(strcmp(key, "stallus") == 0)    emu->stallUs = val;
+        else if(strcmp(key, "seed") == 0)       emu->rng = val ? val : 1;
+        else {
+            free(emu);
+            return CM6206_ERR_PARAM;
+        }
+        params += len;
+        if(*params == ',')  params++;
+    }
+    *handle = emu;
+    return 0;
+}
+
+// Arm timer for the next response, or disarm it if none is queued
+static void emu_arm(struct emu_device *emu) {
+    if(emu->timerfd < 0)    return;
+    uint64_t expirations;
+    while(read(emu->timerfd, &expirations, sizeof(expirations)) > 0) {}    // Clear readable state
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    if(emu->count) {
+        int64_t ready = emu->queue[emu->head].readyNs;
+        its.it_value.tv_sec = ready / 1000000000;
+        its.it_value.tv_nsec = ready % 1000000000;
+    }
+    timerfd_settime(emu->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Output report: Report ID, 0x30 = read / 0x20 = write, DATAL, DATAH, register
+static int emu_write(void *handle, const uint8_t *report, size_t len) {
+    struct emu_device *emu = handle;
+    int64_t latency = emu_latency(emu);
+    if(emu_chance(emu, emu->errorPct)) {
+        emu->error = "Emulated transfer error";
+        return -1;
+    }
+    if(len != 5 || report[4] >= CM6206_NUM_REGS) {
+        emu->error = "Invalid output report";
+        return -1;
+    }
+    if(report[1] == 0x20) {     // Write is acknowledged by the control transfer
+        sleep_ns(latency);
+        emu->regs[report[4]] = report[2] | (report[3] << 8);
+    } else if(report[1] == 0x30 && !emu_chance(emu, emu->dropPct)) {
+        if(emu->count == EMU_QUEUE_SIZE) {
+            emu->error = "Too many outstanding requests";
+            return -1;
+        }
+        struct emu_response *r = &emu->queue[(emu->head + emu->count++) % EMU_QUEUE_SIZE];
+        int64_t prevReady = (emu->count > 1) ? emu->queue[(emu->head + emu->count - 2) % EMU_QUEUE_SIZE].readyNs : 0;
+        r->readyNs = monotonic_ns() + latency;
+        if(r->readyNs < prevReady)  r->readyNs = prevReady;     // Responses are delivered in order
+        uint16_t val = emu->regs[report[4]];
+        r->data[0] = 0x20;
+        r->data[1] = val & 0xff;
+        r->data[2] = val >> 8;
+        if(emu->count == 1)     emu_arm(emu);
+    }
+    return len;
+}
+
+static int emu_read(void *handle, uint8_t *buf, size_t size, int timeoutMs) {
+    struct emu_device *emu = handle;
+    int64_t now = monotonic_ns();
+    int64_t deadline = (timeoutMs < 0) ? INT64_MAX : now + (int64_t)timeoutMs*1000000;
+    if(!emu->count || emu->queue[emu->head].readyNs > deadline) {
+        sleep_ns(timeoutMs < 0 ? 1000000000 : deadline - now);     // Nothing will arrive. Blocking read wakes up each second
+        return 0;
+    }
+    if(emu_chance(emu, emu->errorPct)) {
+        emu->error = "Emulated transfer error";
+        return -1;
+    }
+    struct emu_response *r = &emu->queue[emu->head];
+    sleep_ns(r->readyNs - now);
+    emu->head = (emu->head + 1) % EMU_QUEUE_SIZE;
+    emu->count--;
+    emu_arm(emu);
+    size_t len = (size < sizeof(r->data)) ? size : sizeof(r->data);
+    memcpy(buf, r->data, len);
+    return len;
+}
+
+static void emu_error(void *handle, char *buf, size_t size) {
+    struct emu_device *emu = handle;
+    if(emu->error)  snprintf(buf, size, "%s", emu->error);
+}
+
+static int emu_get_strings(void *handle, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len) {
+    (void)handle;
+    if(manuf)       swprintf(manuf, len, L"C-Media Electronics Inc. (emulated)");
+    if(product)     swprintf(product, len, L"USB Sound Device");
+    if(serial)      swprintf(serial, len, L"EMU0001");
+    return 0;
+}
+
+static void emu_close(void *handle) {
+    struct emu_device *emu = handle;
+    if(emu->timerfd >= 0)   close(emu->timerfd);
+    free(emu);
+}
+
+static int emu_poll_fd(void *handle) {
+    struct emu_device *emu = handle;
+    if(emu->timerfd < 0) {
+        emu->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        emu_arm(emu);
+    }
+    return emu->timerfd;
+}
+
+static const cm6206_transport emu_transport = {
+    "emu", emu_write, emu_read, emu_error, emu_get_strings, emu_close, emu_poll_fd
+};
+
+
+//////// Context and device
+
+cm6206_ctx *cm6206_create(void) {
+    cm6206_ctx *ctx = calloc(1, sizeof(*ctx));
+    if(!ctx)    return NULL;
+    ctx->timeoutMs = CM6206_DEFAULT_TIMEOUT_MS;
+    ctx->retries = CM6206_DEFAULT_RETRIES;
+    return ctx;
+}
+
+int cm6206_open_transport(const cm6206_transport *transport, void *handle, cm6206_ctx **ctx) {
+    *ctx = cm6206_create();
+    if(!*ctx)   return CM6206_ERR_NOMEM;
+    (*ctx)->transport = transport;
+    (*ctx)->handle = handle;
+    return 0;
+}
+
+int cm6206_open_backend(const char *backend, const char *path, cm6206_ctx **ctx) {
+    if(!backend)    backend = CM6206_DEFAULT_BACKEND;
+    const char *params = strchr(backend, ':');
+    size_t namelen = params ? (size_t)(params++ - backend) : strlen(backend);
+    void *handle = NULL;
+    int res = CM6206_ERR_BACKEND;
+    const cm6206_transport *transport = NULL;
+    if(namelen == 6 && strncmp(backend, "hidapi", 6) == 0) {
+        transport = &hidapi_transport;
+        res = hidapi_open(path, &handle);
+    } else if(namelen == 6 && strncmp(backend, "hidraw", 6) == 0) {
+        transport = &hidraw_transport;
+        res = hidraw_open(path, &handle);
+    } else if(namelen == 3 && strncmp(backend, "emu", 3) == 0) {
+        transport = &emu_transport;
+        res = emu_open(params, &handle);
+#ifdef CM6206_WITH_LIBUSB
+    } else if(namelen == 6 && strncmp(backend, "libusb", 6) == 0) {
+        transport = &usbdev_transport;
+        res = usbdev_open(path, &handle);
+#endif
+    }
+    if(res < 0)     return res;
+    res = cm6206_open_transport(transport, handle, ctx);
+    if(res < 0)     transport->close(handle);
+    return res;
+}
+
+int cm6206_open(const char *path, cm6206_ctx **ctx) {
+    return cm6206_open_backend(NULL, path, ctx);
+}
+
+void cm6206_close(cm6206_ctx *ctx) {
+    if(!ctx)    return;
+    if(ctx->loop)   cm6206_loop_remove(ctx);
+    if(ctx->transport)  ctx->transport->close(ctx->handle);
+    free(ctx);
+}
+
+const char *cm6206_error(cm6206_ctx *ctx) {
+    return ctx->errmsg;
+}
+
+void cm6206_set_timeout(cm6206_ctx *ctx, int timeoutMs, int retries) {
+    ctx->timeoutMs = timeoutMs;
+    ctx->retries = retries;
+}
+
+void cm6206_set_pipeline(cm6206_ctx *ctx, bool enable) {
+    ctx->pipeline = enable;
+}
+
+void cm6206_set_async_handler(cm6206_ctx *ctx, void (*handler)(void *user, const uint8_t *report, int len), void *user) {
+    ctx->asyncHandler = handler;
+    ctx->asyncUser = user;
+}
+
+void cm6206_set_write_hook(cm6206_ctx *ctx, void (*hook)(void *user, unsigned reg, uint16_t value), void *user) {
+    ctx->writeHook = hook;
+    ctx->writeUser = user;
+}
+
+void cm6206_set_io_guard(cm6206_ctx *ctx, void (*guard)(void *user, int timeoutMs), void *user) {
+    ctx->ioGuard = guard;
+    ctx->guardUser = user;
+}
+
+void cm6206_get_stats(cm6206_ctx *ctx, cm6206_stats *stats) {
+    *stats = ctx->stats;
+}
+
+void cm6206_reset_stats(cm6206_ctx *ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+unsigned cm6206_get_trace(cm6206_ctx *ctx, cm6206_trace_entry *entries, unsigned max) {
+    unsigned count = (ctx->traceCount < max) ? ctx->traceCount : max;
+    unsigned first = ctx->traceHead + CM6206_TRACE_SIZE - count;   // Newest entries are kept
+    for(unsigned n=0; n<count; n++)     entries[n] = ctx->trace[(first + n) % CM6206_TRACE_SIZE];
+    return count;
+}
+
+void cm6206_clear_trace(cm6206_ctx *ctx) {
+    ctx->traceHead = ctx->traceCount = 0;
+}
+
+int cm6206_get_strings(cm6206_ctx *ctx, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len) {
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "No device");
+    if(!ctx->transport->get_strings)    return 0;
+    return ctx->transport->get_strings(ctx->handle, manuf, product, serial, len);
+}
+
+
+//////// Register I/O
+
+// Get text of last transport error
+static const char *transport_error(cm6206_ctx *ctx) {
+    snprintf(ctx->ioerr, sizeof(ctx->ioerr), "I/O error");
+    if(ctx->transport->error)   ctx->transport->error(ctx->handle, ctx->ioerr, sizeof(ctx->ioerr));
+    return ctx->ioerr;
+}
+
+// Record transfer in trace ring
+static void trace_record(cm6206_ctx *ctx, uint8_t dir, int64_t startNs, const uint8_t *data, int len, int result) {
+    cm6206_trace_entry *e = &ctx->trace[ctx->traceHead];
+    ctx->traceHead = (ctx->traceHead + 1) % CM6206_TRACE_SIZE;
+    if(ctx->traceCount < CM6206_TRACE_SIZE)     ctx->traceCount++;
+    e->timestampNs = startNs;
+    e->durationNs = monotonic_ns() - startNs;
+    e->result = result;
+    e->dir = dir;
+    e->len = (len < 0) ? 0 : (len > (int)sizeof(e->data)) ? (int)sizeof(e->data) : len;
+    memcpy(e->data, data, e->len);
+}
+
+// Add duration of register operation to time and latency histogram
+static void stats_latency(int64_t *totalNs, uint64_t *hist, int64_t ns) {
+    unsigned b = 0;
+    while(b < CM6206_LATENCY_BUCKETS-1 && ns > (CM6206_LATENCY_BASE_NS << b))  b++;
+    hist[b]++;
+    *totalNs += ns;
+}
+
+// Write output report with deadline guard
+static int write_report(cm6206_ctx *ctx, const uint8_t *report, size_t len) {
+    int64_t start = monotonic_ns();
+    if(ctx->ioGuard)    ctx->ioGuard(ctx->guardUser, ctx->timeoutMs);
+    int res = ctx->transport->write(ctx->handle, report, len);
+    if(ctx->ioGuard)    ctx->ioGuard(ctx->guardUser, 0);
+    trace_record(ctx, CM6206_TRACE_WRITE, start, report, len, res);
+    if(res != (int)len) {
+        ctx->stats.errors++;
+        return CM6206_ERR_WRITE;
+    }
+    ctx->stats.reportsWritten++;
+    ctx->stats.bytesWritten += len;
+    return 0;
+}
+
+// Read input report from transport. Returns length, 0 on timeout, -1 on error
+static int read_input(cm6206_ctx *ctx, uint8_t *buf, size_t size, int timeoutMs) {
+    int64_t start = monotonic_ns();
+    int res = ctx->transport->read(ctx->handle, buf, size, timeoutMs);
+    trace_record(ctx, CM6206_TRACE_READ, start, buf, res, res);
+    if(res < 0) {
+        ctx->stats.errors++;
+    } else if(res > 0) {
+        ctx->stats.reportsRead++;
+        ctx->stats.bytesRead += res;
+    }
+    return res;
+}
+
+// Read input reports until a register data report is received or timeout.
+// Other reports are passed to the async handler. Returns 3 on register data, 0 on timeout or error code
+// Responses owed to timed out requests are dropped first. The response of a timed out request is owed
+// unless a response was dropped while waiting (then it was probably the one dropped, and a lost response
+// is not owed forever)
+static int read_response(cm6206_ctx *ctx, uint8_t *buf, size_t size) {
+    int64_t deadline = monotonic_ms() + ctx->timeoutMs;
+    bool dropped = false;
+    while(true) {
+        int remaining = ctx->timeoutMs ? (int)(deadline - monotonic_ms()) : -1;
+        int res = (ctx->timeoutMs && remaining <= 0) ? 0 : read_input(ctx, buf, size, remaining);
+        if (res == 0) { // Timeout
+            ctx->stats.timeouts++;
+            if(!dropped)    ctx->lateResponses++;
+            return 0;
+        }
+        if (res < 3)
+            return CM6206_ERR_READ;
+        if ((buf[0] & 0xe0) == 0x20 && ctx->lateResponses) {    // Late response of earlier request
+            ctx->lateResponses--;
+            dropped = true;
+            continue;
+        }
+        if ((buf[0] & 0xe0) == 0x20)    // Register data
+            return (res == 3) ? 3 : CM6206_ERR_READ;
+        if (!ctx->asyncHandler)         // No register data in the input report
+            return CM6206_ERR_REPORT;
+        ctx->asyncHandler(ctx->asyncUser, buf, res);
+    }
+}
+
+// Discard late register responses, so that they are not mixed up with later reads. Responses carry
+// no register number. Other reports are passed to the async handler
+static void drain_responses(cm6206_ctx *ctx) {
+    uint8_t buf[8];
+    int res;
+    while((res = read_input(ctx, buf, sizeof(buf), PIPELINE_DRAIN_MS)) > 0) {
+        if((buf[0] & 0xe0) != 0x20 && ctx->asyncHandler)    ctx->asyncHandler(ctx->asyncUser, buf, res);
+        else if((buf[0] & 0xe0) == 0x20 && ctx->lateResponses)  ctx->lateResponses--;
+    }
+}
+
+static int read_register(cm6206_ctx *ctx, uint8_t regnum, uint16_t *value) {
+    const uint8_t req[5] = {0x00, // USB Report ID
+            0x30,           // 0x30 = read, 0x20 = write
+            0x00,           // DATAL
+            0x00,           // DATAH
+            regnum          // Register address
+    };
+    uint8_t buf[5];
+
+    if(regnum >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "read: invalid register %u", regnum);
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "read: no device, reg: %u", regnum);
+    for(int attempt=0; attempt<=ctx->retries; attempt++) {
+        if(attempt) {   // The response to the timed out request may still arrive
+            drain_responses(ctx);
+            ctx->stats.retries++;
+        }
+        int res = write_report(ctx, req, sizeof(req));
+        if (res < 0)
+            return set_error(ctx, res, "read: %s, reg: %u", transport_error(ctx), regnum);
+
+        res = read_response(ctx, buf, sizeof(buf));
+        if (res == 0)   // Timeout
+            continue;
+        if (res < 0)
+            return set_error(ctx, res, "read: %s, reg: %u", transport_error(ctx), regnum);
+
+        *value = (((uint16_t)buf[2]) << 8) | buf[1];
+        ctx->regs[regnum] = *value;
+        ctx->valid |= 1u << regnum;
+        if(attempt)     drain_responses(ctx);   // Response of another attempt
+        return 0;
+    }
+    return set_error(ctx, CM6206_ERR_TIMEOUT, "read: no response within %d ms (%d retries), reg: %u",
+        ctx->timeoutMs, ctx->retries, regnum);
+}
+
+int cm6206_read(cm6206_ctx *ctx, uint8_t regnum, uint16_t *value) {
+    if(ctx->asyncCount)     return set_error(ctx, CM6206_ERR_BUSY, "read: requests outstanding, reg: %u", regnum);
+    int64_t start = monotonic_ns();
+    int res = read_register(ctx, regnum, value);
+    stats_latency(&ctx->stats.readNs, ctx->stats.readLatency, monotonic_ns() - start);
+    return res;
+}
+
+// Responses carry no register number and are matched to requests by order. Returns 0 on success.
+// On error any outstanding responses are discarded and the values must be read again in lockstep
+static int read_pipelined(cm6206_ctx *ctx, const uint8_t *regnums, unsigned count, uint16_t *values) {
+    uint8_t buf[5];
+    unsigned sent = 0, received = 0;
+    int res = 0;
+
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "read: no device");
+    for(unsigned n=0; n<count; n++) {
+        if(regnums[n] >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "read: invalid register %u", regnums[n]);
+    }
+    for(; sent<count; sent++) {
+        const uint8_t req[5] = {0x00, 0x30, 0x00, 0x00, regnums[sent]};   // Read request
+        res = write_report(ctx, req, sizeof(req));
+        if (res < 0)
+            break;
+    }
+    for(; received<sent && res==0; received++) {
+        res = read_response(ctx, buf, sizeof(buf));
+        if (res == 0)
+            res = CM6206_ERR_TIMEOUT;
+        else if (res > 0) {
+            values[received] = (((uint16_t)buf[2]) << 8) | buf[1];
+            res = 0;
+        }
+    }
+    if (res != 0) {
+        if(res == CM6206_ERR_TIMEOUT)   ctx->lateResponses += sent - received;  // Requests not waited for
+        drain_responses(ctx);
+        return set_error(ctx, res, "pipelined read: %s", cm6206_strerror(res));
+    }
+    for(unsigned n=0; n<count; n++) {
+        ctx->regs[regnums[n]] = values[n];
+        ctx->valid |= 1u << regnums[n];
+    }
+    return 0;
+}
+
+int cm6206_read_pipelined(cm6206_ctx *ctx, const uint8_t *regnums, unsigned count, uint16_t *values) {
+    if(ctx->asyncCount)     return set_error(ctx, CM6206_ERR_BUSY, "pipelined read: requests outstanding");
+    int64_t start = monotonic_ns();
+    int res = read_pipelined(ctx, regnums, count, values);
+    stats_latency(&ctx->stats.readNs, ctx->stats.readLatency, monotonic_ns() - start);
+    return res;
+}
+
+// The register is marked for re-read on next use
+static int write_register(cm6206_ctx *ctx, uint8_t regnum, uint16_t value) {
+    uint8_t buf[5] = {0x00, // USB Report ID
+            0x20,           // 0x30 = read, 0x20 = write
+            (value & 0xff), // DATAL
+            (value >> 8),   // DATAH
+            regnum          // Register address
+    };
+
+    if(regnum >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "write: invalid register %u", regnum);
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "write: no device, reg: %u", regnum);
+    ctx->valid &= ~(1u << regnum);
+    if(ctx->writeHook)  ctx->writeHook(ctx->writeUser, regnum, value);
+    int64_t start = monotonic_ns();
+    int res = write_report(ctx, buf, sizeof(buf));
+    stats_latency(&ctx->stats.writeNs, ctx->stats.writeLatency, monotonic_ns() - start);
+    if (res < 0)
+        return set_error(ctx, res, "write: %s, reg: %u", transport_error(ctx), regnum);
+    return 0;
+}
+
+int cm6206_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t value) {
+    if(ctx->asyncCount)     return set_error(ctx, CM6206_ERR_BUSY, "write: requests outstanding, reg: %u", regnum);
+    return write_register(ctx, regnum, value);
+}
+
+int cm6206_read_report(cm6206_ctx *ctx, uint8_t *buf, size_t size, int timeoutMs) {
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "read: no device");
+    if(ctx->asyncCount)     return set_error(ctx, CM6206_ERR_BUSY, "read: requests outstanding");
+    int64_t deadline = monotonic_ms() + timeoutMs;
+    while(true) {
+        int remaining = (timeoutMs < 0) ? -1 : (int)(deadline - monotonic_ms());
+        if(timeoutMs >= 0 && remaining < 0)     return 0;
+        int res = read_input(ctx, buf, size, remaining);
+        if(res < 0)     return set_error(ctx, CM6206_ERR_READ, "read: %s", transport_error(ctx));
+        if(res == 0 || (buf[0] & 0xe0) != 0x20)     return res;
+        // Stray register data is ignored
+    }
+}
+
+
+//////// Shadow registers
+
+const uint16_t *cm6206_shadow(cm6206_ctx *ctx, unsigned *valid) {
+    if(valid)   *valid = ctx->valid;
+    return ctx->regs;
+}
+
+void cm6206_set_shadow(cm6206_ctx *ctx, const uint16_t *regs, unsigned valid) {
+    memcpy(ctx->regs, regs, sizeof(ctx->regs));
+    ctx->valid = valid & CM6206_ALL_REGS;
+}
+
+void cm6206_invalidate(cm6206_ctx *ctx, unsigned mask) {
+    ctx->valid &= ~mask;
+}
+
+int cm6206_sync(cm6206_ctx *ctx, unsigned mask) {
+    uint8_t regnums[CM6206_NUM_REGS];
+    unsigned count = 0;
+    for(int n=0; n<CM6206_NUM_REGS; n++) {
+        if((mask & (1u << n)) && !(ctx->valid & (1u << n)))     regnums[count++] = n;
+    }
+    if(ctx->pipeline && !ctx->pipelineFailed && count > 1) {
+        uint16_t values[CM6206_NUM_REGS];
+        if(cm6206_read_pipelined(ctx, regnums, count, values) == 0)     return 0;
+        ctx->pipelineFailed = true;     // Fall back to lockstep reads
+    }
+    for(unsigned n=0; n<count; n++) {
+        uint16_t value;
+        int res = cm6206_read(ctx, regnums[n], &value);
+        if(res < 0)     return res;
+    }
+    return 0;
+}
+
+int cm6206_get(cm6206_ctx *ctx, uint8_t regnum, uint16_t *value) {
+    if(regnum >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "read: invalid register %u", regnum);
+    int res = cm6206_sync(ctx, 1u << regnum);
+    if(res < 0)     return res;
+    *value = ctx->regs[regnum];
+    return 0;
+}
+
+int cm6206_update(cm6206_ctx *ctx, uint8_t regnum, uint16_t mask, uint16_t value) {
+    if(regnum >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "write: invalid register %u", regnum);
+    if(mask != 0xFFFF) {    // Read-modify-write
+        int res = cm6206_sync(ctx, 1u << regnum);
+        if(res < 0)     return res;
+    }
+    return cm6206_write(ctx, regnum, (ctx->regs[regnum] & ~mask) | (value & mask));
+}
+
+int cm6206_plan(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count, uint16_t *values, unsigned *changed) {
+    uint16_t mask[CM6206_NUM_REGS] = {0};
+    uint16_t value[CM6206_NUM_REGS] = {0};
+    unsigned affected = 0;
+    for(unsigned n=0; n<count; n++) {   // Merge settings per register. Later settings take precedence
+        unsigned r = settings[n].reg;
+        if(r >= CM6206_NUM_REGS)    return set_error(ctx, CM6206_ERR_PARAM, "setting: invalid register %u", r);
+        mask[r] |= settings[n].mask;
+        value[r] = (value[r] & ~settings[n].mask) | (settings[n].value & settings[n].mask);
+        if(mask[r])     affected |= 1u << r;
+    }
+    int res = cm6206_sync(ctx, affected);
+    if(res < 0)     return res;
+    int num = 0;
+    *changed = 0;
+    for(int r=0; r<CM6206_NUM_REGS; r++) {
+        if(!(affected & (1u << r)))     continue;
+        uint16_t newvalue = (ctx->regs[r] & ~mask[r]) | value[r];
+        if(newvalue == ctx->regs[r])    continue;   // Unchanged
+        values[r] = newvalue;
+        *changed |= 1u << r;
+        num++;
+    }
+    return num;
+}
+
+// Write register and keep value in shadow without read back
+static int write_trusted(cm6206_ctx *ctx, uint8_t regnum, uint16_t value) {
+    int res = cm6206_write(ctx, regnum, value);
+    if(res < 0)     return res;
+    ctx->regs[regnum] = value;
+    ctx->valid |= 1u << regnum;
+    return 0;
+}
+
+static int apply_settings(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count, bool trusted) {
+    uint16_t values[CM6206_NUM_REGS];
+    unsigned changed;
+    int num = cm6206_plan(ctx, settings, count, values, &changed);
+    if(num < 0)     return num;
+    for(int r=0; r<CM6206_NUM_REGS; r++) {
+        if(!(changed & (1u << r)))  continue;
+        int res = trusted ? write_trusted(ctx, r, values[r]) : cm6206_write(ctx, r, values[r]);
+        if(res < 0)     return res;
+    }
+    return num;
+}
+
+int cm6206_apply(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count) {
+    return apply_settings(ctx, settings, count, false);
+}
+
+int cm6206_apply_trusted(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count) {
+    return apply_settings(ctx, settings, count, true);
+}
+
+
+//////// Write coalescing
+
+static void queue_setting(cm6206_ctx *ctx, unsigned reg, uint16_t mask, uint16_t value) {
+    ctx->pendingMask[reg] |= mask;
+    ctx->pendingValue[reg] = (ctx->pendingValue[reg] & ~mask) | (value & mask);
+}
+
+int cm6206_queue(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count) {
+    for(unsigned n=0; n<count; n++) {   // Nothing is queued if a setting is invalid
+        if(settings[n].reg >= CM6206_NUM_REGS)  return set_error(ctx, CM6206_ERR_PARAM, "setting: invalid register %u", settings[n].reg);
+    }
+    for(unsigned n=0; n<count; n++)     queue_setting(ctx, settings[n].reg, settings[n].mask, settings[n].value);
+    return 0;
+}
+
+int cm6206_queue_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t mask, uint16_t value) {
+    if(regnum >= CM6206_NUM_REGS)   return set_error(ctx, CM6206_ERR_PARAM, "write: invalid register %u", regnum);
+    queue_setting(ctx, regnum, mask, value);
+    ctx->pendingForce |= 1u << regnum;
+    return 0;
+}
+
+unsigned cm6206_pending(cm6206_ctx *ctx) {
+    unsigned pending = 0;
+    for(int r=0; r<CM6206_NUM_REGS; r++) {
+        if(ctx->pendingMask[r])     pending |= 1u << r;
+    }
+    return pending;
+}
+
+void cm6206_discard(cm6206_ctx *ctx) {
+    memset(ctx->pendingMask, 0, sizeof(ctx->pendingMask));
+    memset(ctx->pendingValue, 0, sizeof(ctx->pendingValue));
+    ctx->pendingForce = 0;
+}
+
+int cm6206_commit(cm6206_ctx *ctx, cm6206_commit_result *result) {
+    cm6206_commit_result res = {0};
+    unsigned pending = cm6206_pending(ctx), needed = 0;
+    for(int r=0; r<CM6206_NUM_REGS; r++) {  // Current value is needed to merge or to skip unchanged registers
+        if((pending & (1u << r)) && (ctx->pendingMask[r] != 0xFFFF || !(ctx->pendingForce & (1u << r))))   needed |= 1u << r;
+    }
+    int status = cm6206_sync(ctx, needed);
+    for(int r=0; r<CM6206_NUM_REGS && status >= 0; r++) {
+        if(!(pending & (1u << r)))  continue;
+        bool known = ctx->valid & (1u << r);
+        uint16_t value = ((known ? ctx->regs[r] : 0) & ~ctx->pendingMask[r]) | ctx->pendingValue[r];
+        if(known && value == ctx->regs[r] && !(ctx->pendingForce & (1u << r)))  continue;  // Unchanged
+        res.prev[r] = ctx->regs[r];
+        if(known)   res.prevValid |= 1u << r;
+        res.values[r] = value;
+        status = cm6206_write(ctx, r, value);
+        if(status >= 0)     res.written |= 1u << r;
+    }
+    cm6206_discard(ctx);
+    int64_t readNs = ctx->stats.readNs;
+    if(status >= 0)     status = cm6206_sync(ctx, res.written);     // Verify. One read per written register
+    ctx->stats.verifyNs += ctx->stats.readNs - readNs;     // Accounted as verification instead of read
+    ctx->stats.readNs = readNs;
+    for(int r=0; r<CM6206_NUM_REGS && status >= 0; r++) {
+        if((res.written & (1u << r)) && ctx->regs[r] != res.values[r])  res.mismatch |= 1u << r;
+    }
+    if(result)  *result = res;
+    if(status < 0)  return status;
+    return __builtin_popcount(res.written);
+}
+
+
+//////// GPIO output
+
+// Register and bits of GPIOn (index n-1). GPIO5 has its status bit below its enable bit
+static const struct { uint8_t reg, enableBit, statusBit; } GPIO_BITS[CM6206_NUM_GPIOS] = {
+    {1, 4, 5}, {1, 6, 7}, {1, 8, 9}, {1, 10, 11},
+    {4, 1, 0}, {4, 2, 3}, {4, 4, 5}, {4, 6, 7}, {4, 8, 9}, {4, 10, 11}, {4, 12, 13}, {4, 14, 15}
+};
+static const uint8_t GPIO_REGS[2] = {1, 4};
+#define GPIO_REG_MASK   ((1u << 1) | (1u << 4))
+
+int cm6206_gpio_get(cm6206_ctx *ctx, unsigned *outputs, unsigned *levels) {
+    int res = cm6206_sync(ctx, GPIO_REG_MASK);
+    if(res < 0)     return res;
+    unsigned out = 0, level = 0;
+    for(unsigned n=0; n<CM6206_NUM_GPIOS; n++) {
+        uint16_t regval = ctx->regs[GPIO_BITS[n].reg];
+        if(regval & (1u << GPIO_BITS[n].enableBit))     out |= 1u << n;
+        if(regval & (1u << GPIO_BITS[n].statusBit))     level |= 1u << n;
+    }
+    if(outputs)     *outputs = out;
+    if(levels)      *levels = level;
+    return 0;
+}
+
+int cm6206_gpio_apply(cm6206_ctx *ctx, const cm6206_gpio_step *step) {
+    unsigned used = step->high | step->low | step->toggle | step->release;
+    if(used & ~CM6206_GPIO_ALL)     return set_error(ctx, CM6206_ERR_PARAM, "gpio: invalid GPIO mask 0x%X", used);
+    int res = cm6206_sync(ctx, GPIO_REG_MASK);
+    if(res < 0)     return res;
+    uint16_t values[CM6206_NUM_REGS];
+    memcpy(values, ctx->regs, sizeof(values));
+    for(unsigned n=0; n<CM6206_NUM_GPIOS; n++) {
+        uint16_t *v = &values[GPIO_BITS[n].reg];
+        uint16_t enable = 1u << GPIO_BITS[n].enableBit, status = 1u << GPIO_BITS[n].statusBit;
+        if(step->release & (1u << n))   *v &= ~enable;
+        if(step->high & (1u << n))      *v |= enable | status;
+        if(step->low & (1u << n))       *v = (*v | enable) & ~status;
+        if(step->toggle & (1u << n))    *v = (*v | enable) ^ status;
+    }
+    int num = 0;
+    for(unsigned n=0; n<sizeof(GPIO_REGS); n++) {
+        unsigned r = GPIO_REGS[n];
+        if(values[r] == ctx->regs[r])   continue;   // Unchanged
+        res = write_trusted(ctx, r, values[r]);
+        if(res < 0)     return res;
+        num++;
+    }
+    return num;
+}
+
+int cm6206_gpio_run(cm6206_ctx *ctx, const cm6206_gpio_step *steps, unsigned count, int64_t *startNs) {
+    if(!*startNs)   *startNs = monotonic_ns();
+    for(unsigned n=0; n<count; n++) {
+        if(steps[n].atUs >= 0) {
+            int64_t at = *startNs + steps[n].atUs*1000;
+            struct timespec ts = {at / 1000000000, at % 1000000000};
+            if(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)     return n;
+        }
+        int res = cm6206_gpio_apply(ctx, &steps[n]);
+        if(res < 0)     return res;
+    }
+    return count;
+}
+
+
+//////// Asynchronous requests
+
+struct cm6206_loop {
+    int         epfd;
+    cm6206_ctx  **ctxs;             // Contexts added to loop
+    unsigned    count;
+    unsigned    size;               // Allocated entries of ctxs
+};
+
+cm6206_loop *cm6206_loop_create(void) {
+    cm6206_loop *loop = calloc(1, sizeof(*loop));
+    if(!loop)   return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void cm6206_loop_destroy(cm6206_loop *loop) {
+    if(!loop)   return;
+    while(loop->count)  cm6206_loop_remove(loop->ctxs[loop->count-1]);
+    close(loop->epfd);
+    free(loop->ctxs);
+    free(loop);
+}
+
+int cm6206_loop_add(cm6206_loop *loop, cm6206_ctx *ctx) {
+    if(ctx->loop)   return set_error(ctx, CM6206_ERR_PARAM, "loop: context is already added");
+    if(!ctx->transport)     return set_error(ctx, CM6206_ERR_NODEV, "loop: no device");
+    int fd = ctx->transport->poll_fd ? ctx->transport->poll_fd(ctx->handle) : -1;
+    if(fd < 0)  return set_error(ctx, CM6206_ERR_BACKEND, "loop: backend %s has no pollable descriptor", ctx->transport->name);
+    if(loop->count == loop->size) {
+        unsigned size = loop->size ? loop->size*2 : 8;
+        cm6206_ctx **ctxs = realloc(loop->ctxs, size * sizeof(*ctxs));
+        if(!ctxs)   return set_error(ctx, CM6206_ERR_NOMEM, "loop: out of memory");
+        loop->ctxs = ctxs;
+        loop->size = size;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = ctx};
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)   return set_error(ctx, CM6206_ERR_OPEN, "loop: %s", strerror(errno));
+    loop->ctxs[loop->count++] = ctx;
+    ctx->loop = loop;
+    ctx->pollFd = fd;
+    return 0;
+}
+
+// Complete oldest request of context
+static void async_complete(cm6206_ctx *ctx, int result, uint16_t value) {
+    struct async_request req = ctx->async[ctx->asyncHead];
+    ctx->asyncHead = (ctx->asyncHead + 1) % CM6206_ASYNC_DEPTH;
+    ctx->asyncCount--;
+    ctx->asyncInFlight = false;
+    if(req.callback)    req.callback(ctx, req.user, result, req.regnum, value);
+}
+
+// Complete all outstanding requests of context with error. Returns number of requests
+static int async_fail(cm6206_ctx *ctx, int result) {
+    int count = ctx->asyncCount;    // Requests submitted by callbacks are kept
+    for(int n=0; n<count; n++)  async_complete(ctx, result, 0);
+    return count;
+}
+
+// Stop watching descriptor of failed device. Later requests fail or time out
+static void async_detach(cm6206_ctx *ctx) {
+    if(ctx->pollFd < 0)     return;
+    epoll_ctl(ctx->loop->epfd, EPOLL_CTL_DEL, ctx->pollFd, NULL);
+    ctx->pollFd = -1;
+}
+
+void cm6206_loop_remove(cm6206_ctx *ctx) {
+    cm6206_loop *loop = ctx->loop;
+    if(!loop)   return;
+    if(ctx->asyncInFlight || ctx->lateResponses)    drain_responses(ctx);  // Not mixed up with later reads
+    async_detach(ctx);
+    for(unsigned n=0; n<loop->count; n++) {
+        if(loop->ctxs[n] != ctx)    continue;
+        loop->ctxs[n] = loop->ctxs[--loop->count];
+        break;
+    }
+    ctx->loop = NULL;   // Callbacks can not submit new requests
+    set_error(ctx, CM6206_ERR_NODEV, "request: context removed from loop");
+    async_fail(ctx, CM6206_ERR_NODEV);
+}
+
+// Append request to ring of context
+static int async_submit(cm6206_ctx *ctx, const struct async_request *req) {
+    if(req->regnum >= CM6206_NUM_REGS)  return set_error(ctx, CM6206_ERR_PARAM, "request: invalid register %u", req->regnum);
+    if(!ctx->loop)      return set_error(ctx, CM6206_ERR_PARAM, "request: context is not added to a loop");
+    if(ctx->asyncCount == CM6206_ASYNC_DEPTH)   return set_error(ctx, CM6206_ERR_BUSY, "request: %d requests outstanding", CM6206_ASYNC_DEPTH);
+    ctx->async[(ctx->asyncHead + ctx->asyncCount++) % CM6206_ASYNC_DEPTH] = *req;
+    return 0;
+}
+
+int cm6206_submit_read(cm6206_ctx *ctx, uint8_t regnum, cm6206_callback callback, void *user) {
+    const struct async_request req = {.callback = callback, .user = user, .regnum = regnum};
+    return async_submit(ctx, &req);
+}
+
+int cm6206_submit_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t value, cm6206_callback callback, void *user) {
+    const struct async_request req = {.callback = callback, .user = user, .regnum = regnum, .value = value, .write = true};
+    return async_submit(ctx, &req);
+}
+
+unsigned cm6206_outstanding(cm6206_ctx *ctx) {
+    return ctx->asyncCount;
+}
+
+// Dispatch requests of context until a read is in flight. Returns number of completed requests
+static int async_dispatch(cm6206_ctx *ctx) {
+    int completed = 0;
+    if(ctx->drainUntilMs > monotonic_ms())  return 0;
+    while(ctx->asyncCount && !ctx->asyncInFlight) {
+        struct async_request *req = &ctx->async[ctx->asyncHead];
+        if(req->write) {
+            uint16_t value = req->value;
+            async_complete(ctx, write_register(ctx, req->regnum, value), value);
+            completed++;
+            continue;
+        }
+        const uint8_t report[5] = {0x00, 0x30, 0x00, 0x00, req->regnum};   // Read request
+        int64_t start = monotonic_ns();
+        if(!req->attempt)   req->startNs = start;
+        if(write_report(ctx, report, sizeof(report)) < 0) {
+            stats_latency(&ctx->stats.readNs, ctx->stats.readLatency, monotonic_ns() - req->startNs);
+            set_error(ctx, CM6206_ERR_WRITE, "read: %s, reg: %u", transport_error(ctx), req->regnum);
+            async_complete(ctx, CM6206_ERR_WRITE, 0);
+            completed++;
+            continue;
+        }
+        req->deadlineMs = ctx->timeoutMs ? start/1000000 + ctx->timeoutMs : INT64_MAX;
+        ctx->asyncInFlight = true;
+    }
+    return completed;
+}
+
+// Handle readable descriptor of context. Returns number of completed requests
+static int async_input(cm6206_ctx *ctx) {
+    uint8_t buf[8];
+    int res = read_input(ctx, buf, sizeof(buf), 0);
+    if(res < 0) {
+        set_error(ctx, CM6206_ERR_READ, "read: %s", transport_error(ctx));
+        async_detach(ctx);
+        return async_fail(ctx, CM6206_ERR_READ);
+    }
+    if(res == 0)    return 0;
+    if(res < 3 || (buf[0] & 0xe0) != 0x20) {   // No register data
+        if(ctx->asyncHandler)   ctx->asyncHandler(ctx->asyncUser, buf, res);
+        return 0;
+    }
+    struct async_request *req = &ctx->async[ctx->asyncHead];
+    if(ctx->lateResponses) {    // Late response of expired attempt (see read_response)
+        ctx->lateResponses--;
+        if(ctx->asyncInFlight)  req->dropped = true;
+        return 0;
+    }
+    if(!ctx->asyncInFlight)     return 0;   // Stray register data is ignored
+    stats_latency(&ctx->stats.readNs, ctx->stats.readLatency, monotonic_ns() - req->startNs);
+    if(res != 3) {
+        set_error(ctx, CM6206_ERR_READ, "read: invalid report length %d, reg: %u", res, req->regnum);
+        async_complete(ctx, CM6206_ERR_READ, 0);
+        return 1;
+    }
+    uint16_t value = (((uint16_t)buf[2]) << 8) | buf[1];
+    ctx->regs[req->regnum] = value;
+    ctx->valid |= 1u << req->regnum;
+    if(req->attempt)    ctx->drainUntilMs = monotonic_ms() + PIPELINE_DRAIN_MS; // See read_register
+    async_complete(ctx, 0, value);
+    return 1;
+}
+
+// Resend or fail read in flight after deadline. Returns number of completed requests
+static int async_expire(cm6206_ctx *ctx, int64_t nowMs) {
+    struct async_request *req = &ctx->async[ctx->asyncHead];
+    if(!ctx->asyncInFlight || req->deadlineMs > nowMs)  return 0;
+    ctx->stats.timeouts++;
+    ctx->asyncInFlight = false;
+    if(!req->dropped)   ctx->lateResponses++;   // Response may still arrive
+    req->dropped = false;
+    if(req->attempt < ctx->retries) {   // Resent by next dispatch
+        req->attempt++;
+        ctx->stats.retries++;
+        return 0;
+    }
+    stats_latency(&ctx->stats.readNs, ctx->stats.readLatency, monotonic_ns() - req->startNs);
+    set_error(ctx, CM6206_ERR_TIMEOUT, "read: no response within %d ms (%d retries), reg: %u",
+        ctx->timeoutMs, ctx->retries, req->regnum);
+    async_complete(ctx, CM6206_ERR_TIMEOUT, 0);
+    return 1;
+}
+
+int cm6206_loop_run(cm6206_loop *loop, int timeoutMs) {
+    int completed = 0;
+    int64_t now = monotonic_ms();
+    int64_t wake = (timeoutMs < 0) ? INT64_MAX : now + timeoutMs;
+    for(unsigned n=0; n<loop->count; n++) {     // Callbacks may add contexts
+        cm6206_ctx *ctx = loop->ctxs[n];
+        completed += async_dispatch(ctx);
+        if(ctx->asyncInFlight && ctx->async[ctx->asyncHead].deadlineMs < wake)  wake = ctx->async[ctx->asyncHead].deadlineMs;
+        if(ctx->asyncCount && ctx->drainUntilMs > now && ctx->drainUntilMs < wake)  wake = ctx->drainUntilMs;
+    }
+    int wait = completed ? 0 : (wake == INT64_MAX) ? -1 : (wake > now) ? (int)(wake - now) : 0;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int num = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, wait);
+    if(num < 0 && errno != EINTR)   return CM6206_ERR_READ;
+    for(int n=0; n<num; n++)    completed += async_input(events[n].data.ptr);
+    now = monotonic_ms();
+    for(unsigned n=0; n<loop->count; n++) {
+        cm6206_ctx *ctx = loop->ctxs[n];
+        completed += async_expire(ctx, now);
+        completed += async_dispatch(ctx);
+    }
+    return completed;
+}
+
+
+//////// Shared memory publication
+// Sequence lock: The publisher makes the sequence odd, updates the data and makes it even again.
+// A reader retries if the sequence was odd or changed while the data was copied. All fields are
+// accessed with atomic operations, the ordering is given by the fences.
+
+#define SHM_MAGIC       0x4d534d43  // "CMSM"
+#define SHM_VERSION     2
+#define SHM_MAX_SPINS   1000000     // Retries of reader while the publisher is writing
+
+// Layout of segment
+struct shm_segment {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    sequence;           // Odd while being written
+    uint32_t    valid;
+    int64_t     timestampNs;
+    int32_t     pid;                // Process ID of publisher
+    uint16_t    regs[CM6206_NUM_REGS];
+};
+
+struct cm6206_shm {
+    struct shm_segment *seg;
+    bool        writable;
+};
+
+// Open and map segment. Returns 0 or error code
+static int shm_map(const char *name, bool create, cm6206_shm **shm) {
+    int fd = shm_open(name, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if(fd < 0)  return CM6206_ERR_OPEN;
+    struct stat st;
+    if(create && fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(struct shm_segment)
+    && ftruncate(fd, sizeof(struct shm_segment)) < 0) {
+        close(fd);
+        return CM6206_ERR_OPEN;
+    }
+    if(!create && (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct shm_segment))) {
+        close(fd);
+        errno = EINVAL;     // Not a segment of a publisher
+        return CM6206_ERR_OPEN;
+    }
+    void *addr = mmap(NULL, sizeof(struct shm_segment), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)  return CM6206_ERR_OPEN;
+    *shm = calloc(1, sizeof(**shm));
+    if(!*shm) {
+        munmap(addr, sizeof(struct shm_segment));
+        return CM6206_ERR_NOMEM;
+    }
+    (*shm)->seg = addr;
+    (*shm)->writable = create;
+    return 0;
+}
+
+int cm6206_shm_create(const char *name, cm6206_shm **shm) {
+    int res = shm_map(name, true, shm);
+    if(res < 0)     return res;
+    struct shm_segment *seg = (*shm)->seg;
+    if(seg->magic != SHM_MAGIC || seg->version != SHM_VERSION) {     // New segment. Sequence of old one is continued
+        seg->sequence += seg->sequence & 1;
+        seg->version = SHM_VERSION;
+        __atomic_store_n(&seg->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    } else if(seg->sequence & 1) {
+        seg->sequence++;    // Previous publisher stopped while publishing
+    }
+    return 0;
+}
+
+int cm6206_shm_open(const char *name, cm6206_shm **shm) {
+    int res = shm_map(name, false, shm);
+    if(res < 0)     return res;
+    if(__atomic_load_n(&(*shm)->seg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || (*shm)->seg->version != SHM_VERSION) {
+        cm6206_shm_close(*shm);
+        errno = EINVAL;
+        return CM6206_ERR_OPEN;
+    }
+    return 0;
+}
+
+void cm6206_shm_close(cm6206_shm *shm) {
+    if(!shm)    return;
+    munmap(shm->seg, sizeof(struct shm_segment));
+    free(shm);
+}
+
+int cm6206_shm_publish(cm6206_shm *shm, const uint16_t *regs, unsigned valid, int64_t timestampNs) {
+    if(!shm->writable)  return CM6206_ERR_PARAM;
+    if(!timestampNs) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timestampNs = (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+    }
+    struct shm_segment *seg = shm->seg;
+    uint32_t seq = seg->sequence;
+    __atomic_store_n(&seg->sequence, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // Odd sequence is seen before the data
+    __atomic_store_n(&seg->valid, valid, __ATOMIC_RELAXED);
+    __atomic_store_n(&seg->timestampNs, timestampNs, __ATOMIC_RELAXED);
+    __atomic_store_n(&seg->pid, getpid(), __ATOMIC_RELAXED);
+    for(int r=0; r<CM6206_NUM_REGS; r++)    __atomic_store_n(&seg->regs[r], regs[r], __ATOMIC_RELAXED);
+    __atomic_store_n(&seg->sequence, seq + 2, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int cm6206_shm_read(const cm6206_shm *shm, cm6206_snapshot *snapshot) {
+    const struct shm_segment *seg = shm->seg;
+    for(int spin=0; spin<SHM_MAX_SPINS; spin++) {
+        uint32_t seq = __atomic_load_n(&seg->sequence, __ATOMIC_ACQUIRE);
+        if(seq & 1)     continue;   // Being written
+        snapshot->valid = __atomic_load_n(&seg->valid, __ATOMIC_RELAXED);
+        snapshot->timestampNs = __atomic_load_n(&seg->timestampNs, __ATOMIC_RELAXED);
+        snapshot->pid = __atomic_load_n(&seg->pid, __ATOMIC_RELAXED);
+        for(int r=0; r<CM6206_NUM_REGS; r++)    snapshot->regs[r] = __atomic_load_n(&seg->regs[r], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);    // Data is read before the sequence is checked again
+        if(__atomic_load_n(&seg->sequence, __ATOMIC_RELAXED) != seq)    continue;
+        snapshot->sequence = seq / 2;
+        return seq ? 0 : CM6206_ERR_NODEV;
+    }
+    return CM6206_ERR_BUSY;
+}
+
+
+//////// Register field descriptions
+
+#define FIELD(reg, bit, name, labels)                   {reg, bit, 1, CM6206_FIELD_LABEL, name, labels, NULL}
+#define FIELD_YESNO(reg, bit, name)                     {reg, bit, 1, CM6206_FIELD_LABEL, name, NO_YES, NULL}
+#define FIELD_RANGE(reg, bit, num, name, labels, def)   {reg, bit, num, CM6206_FIELD_LABEL, name, labels, def}
+#define FIELD_NUM(reg, bit, num, name)                  {reg, bit, num, CM6206_FIELD_NUMBER, name, NULL, NULL}
+#define FIELD_RSVD(reg, bit, num)                       {reg, bit, num, CM6206_FIELD_RESERVED, "<Reserved>", NULL, NULL}
+
+// Labels of field values. Indexed by value
+static const char *const NO_YES[2]              = {"No", "Yes"};
+static const char *const DMA_MASTER[2]          = {"DAC", "SPDIF Out"};
+static const char *const SPDIF_OUT_HZ[8]        = {
+    [0] = "44.1 kHz",   // Marked as reserved, but seems to work!
+    [2] = "48 kHz",
+    [3] = "32 kHz",     // Marked as reserved, but seems to work!
+    [6] = "96 kHz"
+};
+static const char *const EMPHASIS[2]            = {"None", "CD_Type"};
+static const char *const COPYRIGHT[2]           = {"Asserted", "Not Asserted"};
+static const char *const NON_AUDIO[2]           = {"PCM", "non-PCM (e.g. AC3)"};
+static const char *const PRO_CONSUMER[2]        = {"Consumer", "Professional"};
+static const char *const SEL_CLK[2]             = {"24.576 MHz", "22.58 MHz"};
+static const char *const HEADPHONE_SOURCES[4]   = {"Side", "Rear", "Center/Subwoofer", "Front"};
+static const char *const MCU_CLK_FREQS[4]       = {"1.5 MHz", "3 MHz"};
+static const char *const MIC_BIAS[2]            = {"4.5 V", "2.25 V"};
+static const char *const MIX_MIC_LINE[2]        = {"All 8 Channels", "Front Out Only"};
+static const char *const SPDIF_IN_HZ[4]         = {
+    [0] = "44.1 kHz",   // Marked as reserved, but seems to work!
+    [2] = "48 kHz",
+    [3] = "32 kHz"      // Marked as reserved, but seems to work!
+};
+static const char *const PACKAGE_SIZE[2]        = {"100 pins", "48 pins"};
+static const char *const SPDIF_OUT_CHANNELS[4]  = {"Front", "Side", "Center", "Rear"};
+static const char *const USB_CODEC_MODE[2]      = {"USB", "CODEC"};
+static const char *const AD_FILTER_SOURCES[8]   = {
+    [0] = "Normal",
+    [4] = "Front",
+    [5] = "Side",
+    [6] = "Center",
+    [7] = "Rear"
+};
+
+// All fields of all registers. Ordered by register and descending bit position
+static const cm6206_field FIELDS[] = {
+    FIELD(0, 15, "DMA Master", DMA_MASTER),
+    FIELD_RANGE(0, 12, 3, "SPDIF Out sample rate", SPDIF_OUT_HZ, "Reserved"),
+    FIELD_NUM(0, 4, 8, "Category code"),
+    FIELD(0, 3, "Emphasis", EMPHASIS),
+    FIELD(0, 2, "Copyright", COPYRIGHT),
+    FIELD(0, 1, "Non-audio", NON_AUDIO),
+    FIELD(0, 0, "Professional/Consumer", PRO_CONSUMER),
+
+    FIELD_RSVD(1, 15, 1),
+    FIELD(1, 14, "SEL Clk (test)", SEL_CLK),
+    FIELD_YESNO(1, 13, "PLL binary search Enable"),
+    FIELD_YESNO(1, 12, "Soft Mute Enable"),
+    FIELD_YESNO(1, 11, "GPIO4 Out Status"),
+    FIELD_YESNO(1, 10, "GPIO4 Out Enable"),
+    FIELD_YESNO(1, 9, "GPIO3 Out Status"),
+    FIELD_YESNO(1, 8, "GPIO3 Out Enable"),
+    FIELD_YESNO(1, 7, "GPIO2 Out Status"),
+    FIELD_YESNO(1, 6, "GPIO2 Out Enable"),
+    FIELD_YESNO(1, 5, "GPIO1 Out Status"),
+    FIELD_YESNO(1, 4, "GPIO1 Out Enable"),
+    FIELD_YESNO(1, 3, "SPDIF Out Valid"),
+    FIELD_YESNO(1, 2, "SPDIF Loop-back Enable"),
+    FIELD_YESNO(1, 1, "SPDIF Out Disable"),
+    FIELD_YESNO(1, 0, "SPDIF In Mix Enable"),
+
+    FIELD_YESNO(2, 15, "Driver On"),
+    FIELD_RANGE(2, 13, 2, "Headphone Source channels", HEADPHONE_SOURCES, "<Reserved>"),
+    FIELD_YESNO(2, 12, "Mute Headphone Right"),
+    FIELD_YESNO(2, 11, "Mute Headphone Left"),
+    FIELD_YESNO(2, 10, "Mute Rear Surround Right"),
+    FIELD_YESNO(2, 9, "Mute Rear Surround Left"),
+    FIELD_YESNO(2, 8, "Mute Side Surround Right"),
+    FIELD_YESNO(2, 7, "Mute Side Surround Left"),
+    FIELD_YESNO(2, 6, "Mute Subwoofer"),
+    FIELD_YESNO(2, 5, "Mute Center"),
+    FIELD_YESNO(2, 4, "Mute Front Right"),
+    FIELD_YESNO(2, 3, "Mute Front Left"),
+    FIELD_YESNO(2, 2, "BTL mode enable"),
+    FIELD_RANGE(2, 0, 2, "MCU Clock Frequency", MCU_CLK_FREQS, "<Reserved>"),
+
+    FIELD_RSVD(3, 14, 2),
+    FIELD_NUM(3, 11, 2, "Sensitivity to FLY tuner volume"),
+    FIELD(3, 10, "Microphone bias voltage", MIC_BIAS),
+    // Note:  Bit 9 is inverted compared to the description in the datasheet.
+    //          However tests have proven the datasheet wrong...
+    FIELD(3, 9, "Mix MIC/Line In to", MIX_MIC_LINE),
+    FIELD_RANGE(3, 7, 2, "SPDIF In sample rate", SPDIF_IN_HZ, "Reserved"),
+    FIELD(3, 6, "Package size", PACKAGE_SIZE),
+    FIELD_YESNO(3, 5, "Front Out Enable"),
+    FIELD_YESNO(3, 4, "Rear Out Enable"),
+    FIELD_YESNO(3, 3, "Center Out Enable"),
+    FIELD_YESNO(3, 2, "Line Out Enable"),
+    FIELD_YESNO(3, 1, "Headphone Out Enable"),
+    FIELD_YESNO(3, 0, "SPDIF In can be recorded"),
+
+    FIELD_YESNO(4, 15, "GPIO12 Out Status"),
+    FIELD_YESNO(4, 14, "GPIO12 Out Enable"),
+    FIELD_YESNO(4, 13, "GPIO11 Out Status"),
+    FIELD_YESNO(4, 12, "GPIO11 Out Enable"),
+    FIELD_YESNO(4, 11, "GPIO10 Out Status"),
+    FIELD_YESNO(4, 10, "GPIO10 Out Enable"),
+    FIELD_YESNO(4, 9, "GPIO9 Out Status"),
+    FIELD_YESNO(4, 8, "GPIO9 Out Enable"),
+    FIELD_YESNO(4, 7, "GPIO8 Out Status"),
+    FIELD_YESNO(4, 6, "GPIO8 Out Enable"),
+    FIELD_YESNO(4, 5, "GPIO7 Out Status"),
+    FIELD_YESNO(4, 4, "GPIO7 Out Enable"),
+    FIELD_YESNO(4, 3, "GPIO6 Out Status"),
+    FIELD_YESNO(4, 2, "GPIO6 Out Enable"),
+    FIELD_YESNO(4, 1, "GPIO5 Out Enable"),
+    FIELD_YESNO(4, 0, "GPIO5 Out Status"),
+
+    FIELD_RSVD(5, 14, 2),
+    FIELD_YESNO(5, 13, "DAC Not Reset"),
+    FIELD_YESNO(5, 12, "ADC Not Reset"),
+    FIELD_YESNO(5, 11, "ADC to SPDIF Out"),
+    FIELD_RANGE(5, 9, 2, "SPDIF Out select", SPDIF_OUT_CHANNELS, "<Reserved>"),
+    FIELD(5, 8, "USB/CODEC Mode", USB_CODEC_MODE),
+    FIELD_YESNO(5, 7, "DAC high pass filter"),
+    FIELD_YESNO(5, 6, "Loopback ADC to Rear DAC"),
+    FIELD_YESNO(5, 5, "Loopback ADC to Center DAC"),
+    FIELD_YESNO(5, 4, "Loopback ADC to Side DAC"),
+    FIELD_YESNO(5, 3, "Loopback ADC to Front DAC"),
+    FIELD_RANGE(5, 0, 3, "Input source to AD digital filter", AD_FILTER_SOURCES, "<Reserved>"),
+};
+#define NUM_FIELDS  (sizeof(FIELDS)/sizeof(FIELDS[0]))
+
+const cm6206_field *cm6206_fields(unsigned *count) {
+    *count = NUM_FIELDS;
+    return FIELDS;
+}
+
+const char *cm6206_field_label(const cm6206_field *f, unsigned val, char *buf, size_t size) {
+    switch(f->type) {
+        case CM6206_FIELD_LABEL:    return f->labels[val] ? f->labels[val] : f->deflabel;
+        case CM6206_FIELD_NUMBER:   snprintf(buf, size, "%u", val); return buf;
+        default:                    return "";
+    }
+}
+
+
+//////// Field index for writing fields by name
+// The index (and the legends of fields) is built once and is read-only afterwards
+
+// Entry in hash index. Key is "<name>" (any value) or "<name>=<label>"
+typedef struct {
+    uint32_t    hash;
+    const cm6206_field *field;  // NULL = empty slot
+    const char  *label;         // NULL = key is name only
+    int         value;          // Field value of label
+    bool        ambiguous;      // Key is not unique
+} FieldIndexEntry;
+
+#define FIELD_INDEX_SIZE    512     // Power of 2. More than twice the number of keys
+static FieldIndexEntry fieldIndex[FIELD_INDEX_SIZE];
+static pthread_once_t fieldIndexOnce = PTHREAD_ONCE_INIT;
+
+// FNV-1a hash of "<name>" or "<name>=<label>" (label may be NULL)
+static uint32_t field_key_hash(const char *name, size_t namelen, const char *label, size_t labellen) {
+    uint32_t hash = 2166136261u;
+    for(size_t n=0; n<namelen; n++)     hash = (hash ^ (uint8_t)name[n]) * 16777619u;
+    if(!label)  return hash;
+    hash = (hash ^ '=') * 16777619u;
+    for(size_t n=0; n<labellen; n++)    hash = (hash ^ (uint8_t)label[n]) * 16777619u;
+    return hash;
+}
+
+// Does index entry match key
+static bool field_key_match(const FieldIndexEntry *e, uint32_t hash, const char *name, size_t namelen, const char *label, size_t labellen) {
+    if(e->hash != hash || (e->label == NULL) != (label == NULL))    return false;
+    if(strncmp(e->field->name, name, namelen) != 0 || e->field->name[namelen] != '\0')  return false;
+    return !label || (strncmp(e->label, label, labellen) == 0 && e->label[labellen] == '\0');
+}
+
+// Find index slot of key. Returns matching or empty slot
+static unsigned field_index_slot(const char *name, size_t namelen, const char *label, size_t labellen, uint32_t *hashp) {
+    uint32_t hash = field_key_hash(name, namelen, label, labellen);
+    unsigned slot = hash & (FIELD_INDEX_SIZE-1);
+    while(fieldIndex[slot].field && !field_key_match(&fieldIndex[slot], hash, name, namelen, label, labellen)) {
+        slot = (slot+1) & (FIELD_INDEX_SIZE-1);     // Linear probing
+    }
+    *hashp = hash;
+    return slot;
+}
+
+// Look up key in index. Returns NULL if not found
+static const FieldIndexEntry *field_index_find(const char *name, size_t namelen, const char *label, size_t labellen) {
+    uint32_t hash;
+    const FieldIndexEntry *e = &fieldIndex[field_index_slot(name, namelen, label, labellen, &hash)];
+    return e->field ? e : NULL;
+}
+
+static void field_index_add(const cm6206_field *f, const char *label, int value) {
+    uint32_t hash;
+    FieldIndexEntry *e = &fieldIndex[field_index_slot(f->name, strlen(f->name), label, label ? strlen(label) : 0, &hash)];
+    if(e->field) {
+        e->ambiguous = true;
+        return;
+    }
+    *e = (FieldIndexEntry){hash, f, label, value, false};
+}
+
+static void build_legends(void);
+
+// Build index of all field names and field name/label pairs
+static void build_field_index(void) {
+    for(const cm6206_field *f = FIELDS; f < FIELDS+NUM_FIELDS; f++) {
+        if(f->type == CM6206_FIELD_RESERVED)    continue;
+        field_index_add(f, NULL, -1);
+        if(f->type != CM6206_FIELD_LABEL)   continue;
+        for(unsigned n=0; n < (1u << f->numbits); n++) {
+            if(f->labels[n])    field_index_add(f, f->labels[n], n);
+        }
+    }
+    build_legends();
+}
+
+const cm6206_field *cm6206_find_field(const char *name) {
+    pthread_once(&fieldIndexOnce, build_field_index);
+    const FieldIndexEntry *e = field_index_find(name, strlen(name), NULL, 0);
+    return (e && !e->ambiguous) ? e->field : NULL;
+}
+
+int cm6206_field_setting(const char *assignment, cm6206_setting *setting) {
+    pthread_once(&fieldIndexOnce, build_field_index);
+    const char *eq = strrchr(assignment, '=');
+    if(!eq)     return CM6206_ERR_PARAM;
+    size_t namelen = eq - assignment;
+    const char *valtxt = eq+1;
+    const FieldIndexEntry *e = field_index_find(assignment, namelen, valtxt, strlen(valtxt));
+    long value = e ? e->value : -1;
+    if(!e) {    // Not a label. Try numeric value
+        e = field_index_find(assignment, namelen, NULL, 0);
+        if(!e)  return CM6206_ERR_FIELD;
+        char *end;
+        value = strtol(valtxt, &end, 0);
+        if(*valtxt == '\0' || *end != '\0' || value < 0 || value > (long)(0xFFFF >> (16 - e->field->numbits)))
+            return CM6206_ERR_VALUE;
+    }
+    if(e->ambiguous)    return CM6206_ERR_AMBIGUOUS;
+    setting->reg = e->field->reg;
+    setting->mask = cm6206_field_mask(e->field);
+    setting->value = value << e->field->firstbit;
+    return 0;
+}
+
+
+//////// Rendering of registers
+
+#define ANSI_HEADER "\e[36m"    // Cyan
+#define ANSI_BOLD   "\e[1m"
+#define ANSI_RESET  "\e[0m"
+#define ANSI_TAB    "\e[43G"    // Column number
+#define ANSI_TAB2   "\e[67G"    // Column number
+
+// State of a single rendering
+struct render {
+    cm6206_buf  *out;
+    enum cm6206_format format;
+    unsigned    flags;
+    uint16_t    fieldMask;      // Only fields overlapping these register bits are printed
+    bool        firstField;     // Next JSON field is first in list (no separator)
+};
+
+// Realtime clock in milliseconds for timestamps in output
+static int64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Make room for at least len more bytes (plus terminator) in buffer. Returns false if out of memory
+static bool buf_reserve(cm6206_buf *out, size_t len) {
+    if(out->failed)     return false;
+    if(out->len + len < out->size)  return true;
+    size_t size = out->size ? out->size : 4096;
+    while(out->len + len >= size)   size *= 2;
+    char *data = realloc(out->data, size);
+    if(!data) {
+        out->failed = true;
+        return false;
+    }
+    out->data = data;
+    out->size = size;
+    return true;
+}
+
+int cm6206_buf_append(cm6206_buf *out, const void *data, size_t len) {
+    if(!buf_reserve(out, len))  return CM6206_ERR_NOMEM;
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+static void buf_puts(cm6206_buf *out, const char *str) {
+    cm6206_buf_append(out, str, strlen(str));
+}
+
+int cm6206_buf_printf(cm6206_buf *out, const char *fmt, ...) {
+    if(!buf_reserve(out, 0))    return CM6206_ERR_NOMEM;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(out->data + out->len, out->size - out->len, fmt, ap);
+    va_end(ap);
+    if(len < 0)     return CM6206_ERR_PARAM;
+    if(out->len + len >= out->size) {   // Did not fit. Grow and render again
+        if(!buf_reserve(out, len))  return CM6206_ERR_NOMEM;
+        va_start(ap, fmt);
+        vsnprintf(out->data + out->len, out->size - out->len, fmt, ap);
+        va_end(ap);
+    }
+    out->len += len;
+    return 0;
+}
+
+int cm6206_buf_write(cm6206_buf *out, int fd) {
+    size_t pos = 0;
+    while(pos < out->len) {
+        ssize_t n = write(fd, out->data + pos, out->len - pos);
+        if(n < 0 && errno == EINTR)     continue;
+        if(n <= 0)  break;
+        pos += n;
+    }
+    int res = (pos < out->len) ? CM6206_ERR_WRITE : out->failed ? CM6206_ERR_NOMEM : 0;
+    out->len = 0;
+    out->failed = false;
+    return res;
+}
+
+void cm6206_buf_free(cm6206_buf *out) {
+    free(out->data);
+    *out = (cm6206_buf){0};
+}
+
+// Print string as JSON string literal
+static void print_json_string(cm6206_buf *out, const char *str) {
+    if(!buf_reserve(out, 2*strlen(str) + 2))    return;
+    char *p = out->data + out->len;
+    *p++ = '"';
+    for(; *str; str++) {
+        if(*str == '"' || *str == '\\')    *p++ = '\\';
+        if((unsigned char)*str >= 0x20)     *p++ = *str;
+    }
+    *p++ = '"';
+    *p = '\0';
+    out->len = p - out->data;
+}
+
+// Verbose legends of all labels of fields, e.g. {0="DAC", 1="SPDIF Out"}. NULL = out of memory
+static char *legends[NUM_FIELDS];
+
+static void build_legends(void) {
+    for(unsigned idx=0; idx<NUM_FIELDS; idx++) {
+        const cm6206_field *f = &FIELDS[idx];
+        if(f->type != CM6206_FIELD_LABEL)   continue;
+        cm6206_buf legend = {0};
+        cm6206_buf_printf(&legend, "%s {", ANSI_TAB2);
+        for(unsigned n=0; n < (1u << f->numbits); n++) {
+            if(f->labels[n])    cm6206_buf_printf(&legend, "%u=\"%s\", ", n, f->labels[n]);
+        }
+        if(legend.failed) {
+            cm6206_buf_free(&legend);
+            continue;
+        }
+        legend.len -= 2;    // Remove last separator
+        buf_puts(&legend, "}");
+        legends[idx] = legend.data;
+    }
+}
+
+static const char *field_legend(const cm6206_field *f) {
+    pthread_once(&fieldIndexOnce, build_field_index);
+    const char *legend = legends[f - FIELDS];
+    return legend ? legend : "";
+}
+
+// Print decoded value of register field as JSON object
+static void print_reg_field_json(struct render *r, const cm6206_field *f, uint16_t regval, const char *valuetxt) {
+    cm6206_buf *out = r->out;
+    uint16_t mask = cm6206_field_mask(f);
+    bool isdefault = (regval & mask) == (cm6206_reg_default[f->reg] & mask);
+    cm6206_buf_printf(out, "%s{\"register\":%u,\"bits\":", r->firstField ? "" : ",", f->reg);
+    if(f->numbits == 1)     cm6206_buf_printf(out, "\"%u\"", f->firstbit);
+    else                    cm6206_buf_printf(out, "\"%u:%u\"", f->firstbit+f->numbits-1, f->firstbit);
+    cm6206_buf_printf(out, ",\"first_bit\":%u,\"width\":%u,\"name\":", f->firstbit, f->numbits);
+    print_json_string(out, f->name);
+    cm6206_buf_printf(out, ",\"raw\":%u,\"label\":", (regval & mask) >> f->firstbit);
+    print_json_string(out, valuetxt);
+    cm6206_buf_printf(out, ",\"is_default\":%s}", isdefault ? "true" : "false");
+    r->firstField = false;
+}
+
+// Print a header for the provided register
+static void print_reg_header(cm6206_buf *out, unsigned regnum, uint16_t regval) {
+    const char *HILIGHT = (regval == cm6206_reg_default[regnum]) ? ANSI_RESET: ANSI_BOLD;
+    cm6206_buf_printf(out, "%s== REG%u == %s", ANSI_HEADER, regnum, ANSI_RESET);
+    cm6206_buf_printf(out, "\t\t%sRaw value: 0x%04X%s\t\t (Reset value: 0x%04X)\n",
+        HILIGHT, regval, ANSI_RESET, cm6206_reg_default[regnum]);
+}
+
+// Print decoded value of register field
+static void print_reg_field(struct render *r, const cm6206_field *f, uint16_t regval) {
+    char numbuf[8];
+    uint16_t mask = cm6206_field_mask(f);
+    if(!(r->fieldMask & mask))  return;
+    unsigned val = (regval & mask) >> f->firstbit;
+    const char *valuetxt = cm6206_field_label(f, val, numbuf, sizeof(numbuf));
+    if(r->format == CM6206_FORMAT_JSON) {
+        print_reg_field_json(r, f, regval, valuetxt);
+        return;
+    }
+    const char *legend = ((r->flags & CM6206_RENDER_VERBOSE) && f->type == CM6206_FIELD_LABEL) ? field_legend(f) : "";
+    bool isdefault = (regval & mask) == (cm6206_reg_default[f->reg] & mask);
+    const char *HILIGHT = (isdefault ? "" : ANSI_BOLD);
+    if(f->numbits == 1) {
+        cm6206_buf_printf(r->out, "%s[%02u] %s%s %s%s%s\n", HILIGHT, f->firstbit, f->name, ANSI_TAB, valuetxt, legend, ANSI_RESET);
+    } else {
+        cm6206_buf_printf(r->out, "%s[%02u:%02u] %s%s %s%s%s\n", HILIGHT, f->firstbit+f->numbits-1, f->firstbit, f->name,
+            ANSI_TAB, valuetxt, legend, ANSI_RESET);
+    }
+}
+
+// Print decoded fields of register
+static void print_cm6202_reg(struct render *r, unsigned regnum, uint16_t val) {
+    for(const cm6206_field *f = FIELDS; f < FIELDS+NUM_FIELDS; f++) {
+        if(f->reg == regnum)    print_reg_field(r, f, val);
+    }
+}
+
+// Print all registers as JSON object
+static void print_cm6202_regs_json(struct render *r, const uint16_t *regs) {
+    cm6206_buf_printf(r->out, "{\"timestamp_ms\":%lld,\"registers\":[", (long long)realtime_ms());
+    for(int n=0; n<CM6206_NUM_REGS; n++) {
+        cm6206_buf_printf(r->out, "%s{\"register\":%u,\"raw\":%u,\"reset\":%u,\"is_default\":%s,\"fields\":[",
+            n ? "," : "", n, regs[n], cm6206_reg_default[n], (regs[n] == cm6206_reg_default[n]) ? "true" : "false");
+        r->firstField = true;
+        print_cm6202_reg(r, n, regs[n]);
+        buf_puts(r->out, "]}");
+    }
+    buf_puts(r->out, "]}\n");
+}
+
+// Print registers as binary record
+static void print_cm6202_regs_binary(cm6206_buf *out, const uint16_t *regs, unsigned valid) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct cm6206_binary_record rec = {
+        .magic = htole32(CM6206_BINARY_MAGIC),
+        .valid = htole16(valid),
+        .timestampNs = htole64((int64_t)ts.tv_sec*1000000000 + ts.tv_nsec)
+    };
+    for(int n=0; n<CM6206_NUM_REGS; n++)    rec.regs[n] = htole16(regs[n]);
+    cm6206_buf_append(out, &rec, sizeof(rec));
+}
+
+int cm6206_render_regs(cm6206_buf *out, const uint16_t *regs, unsigned valid, enum cm6206_format format, unsigned flags) {
+    struct render r = {out, format, flags, 0xFFFF, true};
+    if(format == CM6206_FORMAT_JSON) {
+        print_cm6202_regs_json(&r, regs);
+    } else if(format == CM6206_FORMAT_BINARY) {
+        print_cm6202_regs_binary(out, regs, valid);
+    } else {
+        for(int n=0; n<CM6206_NUM_REGS; n++) {
+            print_reg_header(out, n, regs[n]);
+            if(!(flags & CM6206_RENDER_QUIET))  print_cm6202_reg(&r, n, regs[n]);
+        }
+    }
+    return out->failed ? CM6206_ERR_NOMEM : 0;
+}
+
+// Print the fields which differ between previous and current register values as JSON object
+static void print_cm6202_changes_json(struct render *r, const uint16_t *prev, const uint16_t *cur) {
+    cm6206_buf_printf(r->out, "{\"timestamp_ms\":%lld,\"changes\":[", (long long)realtime_ms());
+    bool first = true;
+    for(int n=0; n<CM6206_NUM_REGS; n++) {
+        uint16_t changed = prev[n] ^ cur[n];
+        if(!changed)    continue;
+        cm6206_buf_printf(r->out, "%s{\"register\":%u,\"old\":%u,\"raw\":%u,\"fields\":[", first ? "" : ",", n, prev[n], cur[n]);
+        r->firstField = true;
+        r->fieldMask = changed;
+        print_cm6202_reg(r, n, cur[n]);
+        buf_puts(r->out, "]}");
+        first = false;
+    }
+    buf_puts(r->out, "]}\n");
+}
+
+int cm6206_render_changes(cm6206_buf *out, const uint16_t *prev, const uint16_t *cur, enum cm6206_format format, unsigned flags) {
+    struct render r = {out, format, flags, 0xFFFF, true};
+    if(format == CM6206_FORMAT_JSON) {
+        print_cm6202_changes_json(&r, prev, cur);
+    } else if(format == CM6206_FORMAT_BINARY) {
+        print_cm6202_regs_binary(out, cur, CM6206_ALL_REGS);
+    } else {
+        for(int n=0; n<CM6206_NUM_REGS; n++) {
+            uint16_t changed = prev[n] ^ cur[n];
+            if(!changed)    continue;
+            cm6206_buf_printf(out, "REG%u: 0x%04X -> 0x%04X\n", n, prev[n], cur[n]);
+            if(!(flags & CM6206_RENDER_QUIET)) {
+                r.fieldMask = changed;
+                print_cm6202_reg(&r, n, cur[n]);
+            }
+        }
+    }
+    return out->failed ? CM6206_ERR_NOMEM : 0;
+}
+
+int cm6206_render_trace(cm6206_buf *out, const cm6206_trace_entry *entries, unsigned count, enum cm6206_format format) {
+    for(unsigned n=0; n<count; n++) {
+        const cm6206_trace_entry *e = &entries[n];
+        char hex[3*sizeof(e->data)+1] = "";
+        for(unsigned b=0; b<e->len; b++)    sprintf(hex + strlen(hex), (format == CM6206_FORMAT_JSON || !b) ? "%02x" : " %02x", e->data[b]);
+        int64_t deltaNs = n ? e->timestampNs - entries[n-1].timestampNs : 0;
+        if(format == CM6206_FORMAT_JSON) {
+            cm6206_buf_printf(out, "{\"t_ns\":%lld,\"duration_ns\":%u,\"dir\":\"%s\",\"data\":\"%s\",\"result\":%d}\n",
+                (long long)e->timestampNs, e->durationNs, (e->dir == CM6206_TRACE_WRITE) ? "write" : "read", hex, e->result);
+        } else {
+            cm6206_buf_printf(out, "%lld.%06lld +%8.1f us %8.1f us %s %-24s %d%s\n",
+                (long long)(e->timestampNs / 1000000000), (long long)(e->timestampNs % 1000000000 / 1000), deltaNs/1e3,
+                e->durationNs/1e3, (e->dir == CM6206_TRACE_WRITE) ? "W" : "R", hex, e->result,
+                (e->result == 0 && e->dir == CM6206_TRACE_READ) ? " (timeout)" : (e->result < 0) ? " (error)" : "");
+        }
+    }
+    return out->failed ? CM6206_ERR_NOMEM : 0;
+}
+
+// Print Prometheus label value in quotes
+static void print_metric_label(cm6206_buf *out, const char *str) {
+    buf_puts(out, "\"");
+    for(const char *p = str; *p; p++) {
+        if(*p == '\\' || *p == '"')     cm6206_buf_printf(out, "\\%c", *p);
+        else if(*p == '\n')             buf_puts(out, "\\n");
+        else                            cm6206_buf_append(out, p, 1);
+    }
+    buf_puts(out, "\"");
+}
+
+// Print field labels of Prometheus sample: register, bits and field name
+static void print_metric_field(cm6206_buf *out, const char *metric, const cm6206_field *f) {
+    cm6206_buf_printf(out, "%s{register=\"%u\",bits=", metric, f->reg);
+    if(f->numbits == 1)     cm6206_buf_printf(out, "\"%u\"", f->firstbit);
+    else                    cm6206_buf_printf(out, "\"%u:%u\"", f->firstbit+f->numbits-1, f->firstbit);
+    buf_puts(out, ",field=");
+    print_metric_label(out, f->name);
+}
+
+// Print latency histogram in seconds
+static void print_metric_histogram(cm6206_buf *out, const char *metric, const char *help, const uint64_t *hist, int64_t sumNs) {
+    cm6206_buf_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+    uint64_t count = 0;
+    for(unsigned b=0; b<CM6206_LATENCY_BUCKETS-1; b++) {
+        count += hist[b];
+        cm6206_buf_printf(out, "%s_bucket{le=\"%g\"} %llu\n", metric, (CM6206_LATENCY_BASE_NS << b)/1e9, (unsigned long long)count);
+    }
+    count += hist[CM6206_LATENCY_BUCKETS-1];
+    cm6206_buf_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n", metric, (unsigned long long)count);
+    cm6206_buf_printf(out, "%s_sum %.9f\n%s_count %llu\n", metric, sumNs/1e9, metric, (unsigned long long)count);
+}
+
+int cm6206_render_metrics(cm6206_buf *out, const uint16_t *regs, unsigned valid, const cm6206_stats *stats) {
+    buf_puts(out, "# HELP cm6206_register Raw register value\n# TYPE cm6206_register gauge\n");
+    for(unsigned n=0; n<CM6206_NUM_REGS; n++) {
+        if(valid & (1u << n))   cm6206_buf_printf(out, "cm6206_register{register=\"%u\"} %u\n", n, regs[n]);
+    }
+    buf_puts(out, "# HELP cm6206_field Raw value of register field\n# TYPE cm6206_field gauge\n");
+    for(const cm6206_field *f = FIELDS; f < FIELDS+NUM_FIELDS; f++) {
+        if(f->type == CM6206_FIELD_RESERVED || !(valid & (1u << f->reg)))    continue;
+        print_metric_field(out, "cm6206_field", f);
+        cm6206_buf_printf(out, "} %u\n", (regs[f->reg] & cm6206_field_mask(f)) >> f->firstbit);
+    }
+    buf_puts(out, "# HELP cm6206_field_info Decoded label of register field\n# TYPE cm6206_field_info gauge\n");
+    for(const cm6206_field *f = FIELDS; f < FIELDS+NUM_FIELDS; f++) {
+        if(f->type != CM6206_FIELD_LABEL || !(valid & (1u << f->reg)))  continue;
+        char numbuf[8];
+        print_metric_field(out, "cm6206_field_info", f);
+        buf_puts(out, ",label=");
+        print_metric_label(out, cm6206_field_label(f, (regs[f->reg] & cm6206_field_mask(f)) >> f->firstbit, numbuf, sizeof(numbuf)));
+        buf_puts(out, "} 1\n");
+    }
+    if(!stats)  return out->failed ? CM6206_ERR_NOMEM : 0;
+
+    const struct { const char *name, *help; uint64_t value; } counters[] = {
+        {"cm6206_reports_written_total", "Output reports written", stats->reportsWritten},
+        {"cm6206_reports_read_total", "Input reports read", stats->reportsRead},
+        {"cm6206_written_bytes_total", "Bytes of output reports", stats->bytesWritten},
+        {"cm6206_read_bytes_total", "Bytes of input reports", stats->bytesRead},
+        {"cm6206_retries_total", "Register read requests resent after timeout", stats->retries},
+        {"cm6206_timeouts_total", "Register responses not received within deadline", stats->timeouts},
+        {"cm6206_errors_total", "Failed transfers", stats->errors},
+    };
+    for(unsigned n=0; n<sizeof(counters)/sizeof(counters[0]); n++) {
+        cm6206_buf_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[n].name, counters[n].help,
+            counters[n].name, counters[n].name, (unsigned long long)counters[n].value);
+    }
+    print_metric_histogram(out, "cm6206_read_latency_seconds", "Duration of register reads (including read back)",
+        stats->readLatency, stats->readNs + stats->verifyNs);
+    print_metric_histogram(out, "cm6206_write_latency_seconds", "Duration of register writes", stats->writeLatency, stats->writeNs);
+    return out->failed ? CM6206_ERR_NOMEM : 0;
+}
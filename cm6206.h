@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: GPL-2.0+
+//
+// libcm6206: Library to control registers of a CM6206 based USB sound card
+// Copyright (C) 2019 Tommy Vestermark (tovsurf@vestermark.dk)
+//
+// All state is kept in a context. Separate contexts can be used from different threads.
+// Functions return 0 (or a positive count) on success and a negative CM6206_ERR_* code on error.
+
+#ifndef CM6206_H
+#define CM6206_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// USB ID's for C-Media Electronics CM6206
+#define CM6206_VENDOR_ID    0x0d8c
+#define CM6206_PRODUCT_ID   0x0102
+#define CM6206_NUM_REGS     6
+#define CM6206_ALL_REGS     ((1u << CM6206_NUM_REGS) - 1)
+
+// Default I/O deadline and number of retries of a register read
+#define CM6206_DEFAULT_TIMEOUT_MS   1000
+#define CM6206_DEFAULT_RETRIES      2
+
+// Error codes
+#define CM6206_ERR_WRITE    -1      // Output report could not be written
+#define CM6206_ERR_READ     -2      // Input report could not be read
+#define CM6206_ERR_REPORT   -3      // No register data in the input report
+#define CM6206_ERR_TIMEOUT  -4      // No input report within deadline
+#define CM6206_ERR_OPEN     -5      // Device could not be opened
+#define CM6206_ERR_NODEV    -6      // Context has no device
+#define CM6206_ERR_PARAM    -7      // Invalid parameter
+#define CM6206_ERR_NOMEM    -8      // Out of memory
+#define CM6206_ERR_FIELD    -9      // Unknown field name
+#define CM6206_ERR_VALUE    -10     // Invalid field value
+#define CM6206_ERR_AMBIGUOUS -11    // Field setting is not unique
+#define CM6206_ERR_BACKEND  -12     // Unknown backend or not included in build
+#define CM6206_ERR_BUSY     -13     // Too many outstanding requests, or synchronous I/O with outstanding requests
+
+typedef struct cm6206_ctx cm6206_ctx;
+
+// Setting of register bits. Bits in mask are set to value
+typedef struct { uint8_t reg; uint16_t mask; uint16_t value; } cm6206_setting;
+
+// Default values for registers after reset
+extern const uint16_t cm6206_reg_default[CM6206_NUM_REGS];
+
+// Built-in profile for initialization of registers (same as Linux driver)
+extern const cm6206_setting cm6206_profile_init[];
+extern const unsigned cm6206_profile_init_count;
+
+// Text of error code
+const char *cm6206_strerror(int error);
+
+
+//////// Context and device
+
+// Transport of reports to and from a device. Output reports start with the report ID (0)
+typedef struct {
+    const char  *name;
+    int     (*write)(void *handle, const uint8_t *report, size_t len);  // Returns len or -1 on error
+    int     (*read)(void *handle, uint8_t *buf, size_t size, int timeoutMs);   // Returns length, 0 on timeout, -1 on error
+    void    (*error)(void *handle, char *buf, size_t size);     // Text of last error (optional)
+    int     (*get_strings)(void *handle, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len);  // (optional)
+    void    (*close)(void *handle);
+    int     (*poll_fd)(void *handle);   // Descriptor readable when input reports are available (optional)
+} cm6206_transport;
+
+// Create context without device. Only registers loaded with cm6206_set_shadow() can be read
+cm6206_ctx *cm6206_create(void);
+
+// Open device by hidapi path (NULL = first device found) in new context
+int cm6206_open(const char *path, cm6206_ctx **ctx);
+
+// Open device with backend "<name>[:<parameters>]" in new context (NULL = build default, normally "hidapi"). Backends:
+//  hidapi  Device by hidapi path
+//  hidraw  Device by hidraw node (e.g. "/dev/hidraw2") or hidapi-libusb path, with read/write/poll
+//          on the kernel HID driver. The device can be shared with other programs
+//  libusb  Device by hidapi-libusb path, with synchronous libusb transfers on the calling thread.
+//          Only if built with CM6206_WITH_LIBUSB. Detaches the kernel driver while open
+//  emu     Emulated CM6206. Path is ignored. Parameters (all optional):
+//          "latency=<us>,jitter=<us>,drop=<%>,error=<%>,stall=<%>,stallus=<us>,seed=<n>"
+int cm6206_open_backend(const char *backend, const char *path, cm6206_ctx **ctx);
+
+// Create context using transport. Transport is closed with the context
+int cm6206_open_transport(const cm6206_transport *transport, void *handle, cm6206_ctx **ctx);
+
+void cm6206_close(cm6206_ctx *ctx);
+
+// Detailed text of last error in context
+const char *cm6206_error(cm6206_ctx *ctx);
+
+// Set I/O deadline in ms (0 = wait forever) and number of retries of a register read
+void cm6206_set_timeout(cm6206_ctx *ctx, int timeoutMs, int retries);
+
+// Queue register read requests before collecting responses. Falls back to lockstep on failure
+void cm6206_set_pipeline(cm6206_ctx *ctx, bool enable);
+
+// Handler of asynchronous input reports (e.g. button events). NULL = discard reports
+void cm6206_set_async_handler(cm6206_ctx *ctx, void (*handler)(void *user, const uint8_t *report, int len), void *user);
+
+// Hook called before a register is written (e.g. to invalidate caches)
+void cm6206_set_write_hook(cm6206_ctx *ctx, void (*hook)(void *user, unsigned reg, uint16_t value), void *user);
+
+// Guard called with the deadline before and with 0 after operations without timeout support (write)
+void cm6206_set_io_guard(cm6206_ctx *ctx, void (*guard)(void *user, int timeoutMs), void *user);
+
+// Get manufacturer, product and serial number strings (wide strings of len characters)
+int cm6206_get_strings(cm6206_ctx *ctx, wchar_t *manuf, wchar_t *product, wchar_t *serial, size_t len);
+
+// Transfer counters and time spent in register I/O of a context
+#define CM6206_LATENCY_BUCKETS  12          // Buckets of latency histograms
+#define CM6206_LATENCY_BASE_NS  125000LL    // Bucket n counts operations up to BASE << n. The last counts all longer
+
+typedef struct {
+    uint64_t    reportsWritten;     // Output reports written
+    uint64_t    reportsRead;        // Input reports read (register data and other reports)
+    uint64_t    bytesWritten;
+    uint64_t    bytesRead;
+    uint64_t    retries;            // Register read requests resent after timeout
+    uint64_t    timeouts;           // Register responses not received within deadline
+    uint64_t    errors;             // Failed transfers
+    int64_t     readNs;             // Time in register reads
+    int64_t     writeNs;            // Time in register writes
+    int64_t     verifyNs;           // Time in read back of written registers (cm6206_commit)
+    uint64_t    readLatency[CM6206_LATENCY_BUCKETS];    // Register reads (also read back) by duration
+    uint64_t    writeLatency[CM6206_LATENCY_BUCKETS];   // Register writes by duration
+} cm6206_stats;
+
+void cm6206_get_stats(cm6206_ctx *ctx, cm6206_stats *stats);
+void cm6206_reset_stats(cm6206_ctx *ctx);
+
+// Trace of the last transfers of a context. Recorded into a fixed ring without allocation
+#define CM6206_TRACE_SIZE   256     // Number of transfers kept
+#define CM6206_TRACE_WRITE  0
+#define CM6206_TRACE_READ   1
+
+typedef struct {
+    int64_t     timestampNs;        // Start of transfer (monotonic clock)
+    uint32_t    durationNs;
+    int16_t     result;             // Result of transport (length, 0 = timeout, -1 = error)
+    uint8_t     dir;                // CM6206_TRACE_WRITE or CM6206_TRACE_READ
+    uint8_t     len;                // Number of report bytes in data
+    uint8_t     data[8];            // Start of report
+} cm6206_trace_entry;
+
+// Copy up to max trace entries (oldest first). Returns number of entries
+unsigned cm6206_get_trace(cm6206_ctx *ctx, cm6206_trace_entry *entries, unsigned max);
+void cm6206_clear_trace(cm6206_ctx *ctx);
+
+
+//////// Register I/O
+
+// Read register from device. A request without response is resent up to retries times
+int cm6206_read(cm6206_ctx *ctx, uint8_t regnum, uint16_t *value);
+
+// Read several registers with all requests queued before the responses are collected
+int cm6206_read_pipelined(cm6206_ctx *ctx, const uint8_t *regnums, unsigned count, uint16_t *values);
+
+// Write register to device
+int cm6206_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t value);
+
+// Read next input report which is not register data (timeout -1 = forever). Returns length, 0 on timeout
+int cm6206_read_report(cm6206_ctx *ctx, uint8_t *buf, size_t size, int timeoutMs);
+
+
+//////// Shadow registers
+// The context keeps a shadow copy of the registers. Registers are only read from the device when
+// needed, and a written register is read back on next use.
+
+// Get shadow registers and bitmask of registers in sync with device
+const uint16_t *cm6206_shadow(cm6206_ctx *ctx, unsigned *valid);
+
+// Load shadow registers (e.g. from a cache). Registers in valid are considered in sync
+void cm6206_set_shadow(cm6206_ctx *ctx, const uint16_t *regs, unsigned valid);
+
+// Mark registers in mask for re-read from device
+void cm6206_invalidate(cm6206_ctx *ctx, unsigned mask);
+
+// Make sure registers in mask are in sync with device. Only reads registers if needed
+int cm6206_sync(cm6206_ctx *ctx, unsigned mask);
+
+// Get register value. Read from device if needed
+int cm6206_get(cm6206_ctx *ctx, uint8_t regnum, uint16_t *value);
+
+// Set bits in mask of register to value. The register is only read if mask is partial
+int cm6206_update(cm6206_ctx *ctx, uint8_t regnum, uint16_t mask, uint16_t value);
+
+// Plan settings without writing. Settings are merged per register (later settings take precedence)
+// and the affected registers are synced. New values of registers which change value are stored in
+// values and marked in changed. Returns number of registers which change value
+int cm6206_plan(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count, uint16_t *values, unsigned *changed);
+
+// Apply settings. Only registers which change value are written. Returns number of registers written
+int cm6206_apply(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count);
+
+// Apply settings like cm6206_apply, but keep the written values in the shadow without read back.
+// For registers the device does not change by itself, so that a later change costs a single write
+int cm6206_apply_trusted(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count);
+
+
+//////// Write coalescing
+// Settings are queued and merged per register until they are committed. A commit writes each touched
+// register at most once and verifies it with a single read. Queued settings are not seen by reads
+// before they are committed.
+
+// Result of a commit
+typedef struct {
+    unsigned    written;                    // Bitmask of registers written
+    unsigned    prevValid;                  // Written registers with known previous value
+    unsigned    mismatch;                   // Written registers which read back a different value
+    uint16_t    prev[CM6206_NUM_REGS];      // Previous values of written registers
+    uint16_t    values[CM6206_NUM_REGS];    // Values written
+} cm6206_commit_result;
+
+// Queue settings. Only registers which change value are written on commit
+int cm6206_queue(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count);
+
+// Queue raw write of bits in mask. The register is written on commit even if unchanged, and is
+// only read first if the merged mask is partial
+int cm6206_queue_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t mask, uint16_t value);
+
+// Bitmask of registers with queued settings
+unsigned cm6206_pending(cm6206_ctx *ctx);
+
+// Drop queued settings
+void cm6206_discard(cm6206_ctx *ctx);
+
+// Write queued settings and read back written registers. Queue is empty afterwards, also on error
+// Result is optional. Returns number of registers written
+int cm6206_commit(cm6206_ctx *ctx, cm6206_commit_result *result);
+
+
+//////// GPIO output
+// GPIO1-12 are driven through the out enable and out status bits of REG1 and REG4. The registers are
+// read once into the shadow. Changes are written back to back from the shadow without read back, so
+// the toggle rate is only limited by the USB interval. Invalidating REG1 or REG4 reloads them.
+
+#define CM6206_NUM_GPIOS    12
+#define CM6206_GPIO(n)      (1u << ((n)-1))     // Bit of GPIOn (1-12) in GPIO masks
+#define CM6206_GPIO_ALL     0x0FFF
+
+// Change of GPIO outputs. Applied in order release, high, low, toggle
+typedef struct {
+    int64_t     atUs;       // Time of step relative to start of schedule (-1 = right after previous step)
+    uint16_t    high;       // GPIOs driven high
+    uint16_t    low;        // GPIOs driven low
+    uint16_t    toggle;     // GPIOs driven to the inverse of their level
+    uint16_t    release;    // GPIOs switched to input (out enable cleared)
+} cm6206_gpio_step;
+
+// Get GPIOs enabled as outputs and their levels. Reads REG1 and REG4 if needed
+int cm6206_gpio_get(cm6206_ctx *ctx, unsigned *outputs, unsigned *levels);
+
+// Apply step now (atUs is ignored). Only registers which change value are written
+// Returns number of registers written
+int cm6206_gpio_apply(cm6206_ctx *ctx, const cm6206_gpio_step *step);
+
+// Apply steps at their times. The schedule starts at *startNs (monotonic clock), which is set to
+// now if 0. Late steps are applied at once. Returns number of steps applied (less than count if
+// interrupted by a signal)
+int cm6206_gpio_run(cm6206_ctx *ctx, const cm6206_gpio_step *steps, unsigned count, int64_t *startNs);
+
+
+//////// Asynchronous requests
+// An event loop serves the devices of many contexts from one thread with epoll. Requests are queued
+// per context and completed in order of submission by callbacks from cm6206_loop_run(). Responses
+// carry no register number, so each context has one read in flight while the devices are served
+// concurrently. Writes are done when dispatched and do not wait for other devices.
+// The loop and its contexts must be used from one thread. A context must not be removed or closed
+// from its callbacks. Synchronous register I/O fails with CM6206_ERR_BUSY while requests are outstanding.
+
+#define CM6206_ASYNC_DEPTH  32      // Max number of outstanding requests per context
+
+typedef struct cm6206_loop cm6206_loop;
+
+// Completion of request. Result is 0 or error code (see cm6206_error). Value is the value read or written
+typedef void (*cm6206_callback)(cm6206_ctx *ctx, void *user, int result, uint8_t regnum, uint16_t value);
+
+cm6206_loop *cm6206_loop_create(void);
+
+// Remove all contexts and free loop
+void cm6206_loop_destroy(cm6206_loop *loop);
+
+// Add context to loop. Returns CM6206_ERR_BACKEND if the transport has no pollable descriptor
+int cm6206_loop_add(cm6206_loop *loop, cm6206_ctx *ctx);
+
+// Remove context from its loop. Outstanding requests fail with CM6206_ERR_NODEV. Done by cm6206_close()
+void cm6206_loop_remove(cm6206_ctx *ctx);
+
+// Queue read of register. The register is stored in the shadow registers on completion
+int cm6206_submit_read(cm6206_ctx *ctx, uint8_t regnum, cm6206_callback callback, void *user);
+
+// Queue write of register. The register is marked for re-read as with cm6206_write()
+int cm6206_submit_write(cm6206_ctx *ctx, uint8_t regnum, uint16_t value, cm6206_callback callback, void *user);
+
+// Number of outstanding requests of context
+unsigned cm6206_outstanding(cm6206_ctx *ctx);
+
+// Dispatch queued requests and wait up to timeout (-1 = forever, 0 = do not wait) for responses.
+// Input reports which are not register data are passed to the async handler of the context.
+// Returns number of completed requests or error code
+int cm6206_loop_run(cm6206_loop *loop, int timeoutMs);
+
+
+//////// Shared memory publication
+// A publisher (e.g. the daemon) keeps the registers in a POSIX shared memory segment guarded by a
+// sequence lock. Readers map the segment once and get consistent snapshots without system calls.
+// The segment is kept when the publisher ends, so readers continue when it is started again.
+
+typedef struct cm6206_shm cm6206_shm;
+
+// Snapshot of published registers
+typedef struct {
+    uint16_t    regs[CM6206_NUM_REGS];
+    unsigned    valid;              // Bitmask of valid registers (0 = device not available)
+    int64_t     timestampNs;        // Time of sample (realtime clock)
+    int         pid;                // Process ID of publisher. Kept in the segment if it ended without closing
+    uint64_t    sequence;           // Number of publications
+} cm6206_snapshot;
+
+// Create segment (e.g. "/cm6206ctl") or open it for publishing. Readable by all users
+int cm6206_shm_create(const char *name, cm6206_shm **shm);
+
+// Open segment for reading
+int cm6206_shm_open(const char *name, cm6206_shm **shm);
+
+void cm6206_shm_close(cm6206_shm *shm);
+
+// Publish registers sampled at timestamp (realtime clock, 0 = now). Only one publisher per segment
+int cm6206_shm_publish(cm6206_shm *shm, const uint16_t *regs, unsigned valid, int64_t timestampNs);
+
+// Get consistent snapshot. Returns 0, CM6206_ERR_NODEV if nothing was published yet
+// or CM6206_ERR_BUSY if the publisher stopped while publishing
+int cm6206_shm_read(const cm6206_shm *shm, cm6206_snapshot *snapshot);
+
+
+//////// Register fields
+
+// Type of register field
+enum cm6206_field_type {
+    CM6206_FIELD_LABEL,     // Value is decoded with labels
+    CM6206_FIELD_NUMBER,    // Value is printed as number
+    CM6206_FIELD_RESERVED   // Value is not printed
+};
+
+// Description of field in register
+typedef struct {
+    uint8_t     reg;
+    uint8_t     firstbit;
+    uint8_t     numbits;
+    uint8_t     type;               // enum cm6206_field_type
+    const char  *name;
+    const char  *const *labels;     // CM6206_FIELD_LABEL: Label per field value (NULL = no label). 1<<numbits entries
+    const char  *deflabel;          // CM6206_FIELD_LABEL: Label of values without label
+} cm6206_field;
+
+// Get table of all fields. Ordered by register and descending bit position
+const cm6206_field *cm6206_fields(unsigned *count);
+
+// Mask of field bits within register
+static inline uint16_t cm6206_field_mask(const cm6206_field *f) {
+    return (0xFFFF >> (16 - f->numbits)) << f->firstbit;
+}
+
+// Get decoded text of field value. Numbers are formatted into provided buffer
+const char *cm6206_field_label(const cm6206_field *f, unsigned val, char *buf, size_t size);
+
+// Find field by name. Returns NULL if unknown or ambiguous
+const cm6206_field *cm6206_find_field(const char *name);
+
+// Resolve "<field name>=<label or value>" into register setting
+int cm6206_field_setting(const char *assignment, cm6206_setting *setting);
+
+
+//////// Rendering of registers
+
+// Growable output buffer. Initialize to zero. Data is kept zero terminated
+typedef struct {
+    char    *data;
+    size_t  len;
+    size_t  size;
+    bool    failed;     // Allocation failed. Further output is discarded
+} cm6206_buf;
+
+enum cm6206_format { CM6206_FORMAT_TEXT, CM6206_FORMAT_JSON, CM6206_FORMAT_BINARY };
+
+#define CM6206_RENDER_VERBOSE   0x01    // Text: Add legend of all labels
+#define CM6206_RENDER_QUIET     0x02    // Text: Only raw register values
+
+// Binary record of register values. All fields are little endian (convert with le16toh() etc.)
+#define CM6206_BINARY_MAGIC     0x36324d43  // "CM26"
+struct __attribute__((packed)) cm6206_binary_record {
+    uint32_t    magic;
+    uint16_t    valid;              // Bitmask of valid registers
+    uint16_t    regs[CM6206_NUM_REGS];
+    int64_t     timestampNs;        // Time of sample (realtime clock)
+};
+
+int cm6206_buf_printf(cm6206_buf *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int cm6206_buf_append(cm6206_buf *out, const void *data, size_t len);
+
+// Write buffer to file descriptor with a single write and empty it (keeping the allocation)
+// Returns 0 on success, CM6206_ERR_WRITE if write failed or CM6206_ERR_NOMEM if output was lost
+int cm6206_buf_write(cm6206_buf *out, int fd);
+
+void cm6206_buf_free(cm6206_buf *out);
+
+// Render registers in format. The valid mask is only recorded in binary records
+int cm6206_render_regs(cm6206_buf *out, const uint16_t *regs, unsigned valid, enum cm6206_format format, unsigned flags);
+
+// Render the fields which differ between previous and current register values
+int cm6206_render_changes(cm6206_buf *out, const uint16_t *prev, const uint16_t *cur, enum cm6206_format format, unsigned flags);
+
+// Render trace entries as text (one transfer per line) or JSON (one object per line)
+int cm6206_render_trace(cm6206_buf *out, const cm6206_trace_entry *entries, unsigned count, enum cm6206_format format);
+
+// Render valid registers, their fields and the counters and latency histograms of stats (NULL = none)
+// in Prometheus text exposition format
+int cm6206_render_metrics(cm6206_buf *out, const uint16_t *regs, unsigned valid, const cm6206_stats *stats);
+
+#endif // CM6206_H
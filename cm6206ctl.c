@@ -4,55 +4,84 @@
 // Copyright (C) 2019 Tommy Vestermark (tovsurf@vestermark.dk)
 //
 // Bulding:
-// $ gcc cm6206ctl.c -l hidapi-libusb -o cm6206ctl
+// $ gcc -pthread cm6206ctl.c cm6206.c -l hidapi-libusb -o cm6206ctl
+//
+// With libusb backend (-B libusb):
+// $ gcc -pthread -DCM6206_WITH_LIBUSB cm6206ctl.c cm6206.c -l hidapi-libusb -l usb-1.0 -o cm6206ctl
 //
 // Dependencies:
 // - libhidapi-dev
+// - libusb-1.0-0-dev (optional)
 
 #include <assert.h>
 #include <err.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include <unistd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <linux/netlink.h>
 #include <hidapi/hidapi.h>
+#include "cm6206.h"
 
 //////// Global constants
 
-// USB ID's for C-Media Electronics CM6202
-#define USB_VENDOR_ID   0x0d8c
-#define USB_PRODUCT_ID  0x0102
-#define NUM_REGS        6
-
-// Default values for registers after reset
-static const uint16_t REG_DEFAULT[NUM_REGS] = {
-    0x2000,
-    0x3002,
-    0x6004,
-    0x147f,
-    0x0000,
-    0x3000
-};
-
-// Register values for initialization
-static const uint16_t REG_INIT[NUM_REGS] = {
-    0x2004,     // Do not assert copyright
-    0x3000,     // Enable SPDIF Out
-    0xF800,     // Enable drivers. Mute Headphone. Disable BTL
-    0x147f,
-    0x0000,
-    0x3000
-};
+#define EXIT_TIMEOUT        3       // Exit status if the device did not respond in time
+#define DEFAULT_CACHE_DIR   "/run/cm6206ctl"
+#define SYSFS_USB_DEVICES   "/sys/bus/usb/devices"
+#define ALSA_PROC_DIR       "/proc/asound"
+#define ALSA_DEV_DIR        "/dev/snd"
+#define HID_INTERFACE       3       // USB interface number of the CM6206 HID interface
+#define REOPEN_ATTEMPTS     10      // Attempts to open a plugged in device while it is being set up
+#define REOPEN_DELAY_MS     100
+#define MAX_PROFILE_SETTINGS 256    // Max number of settings in a profile file
+#define MAX_BENCH_BACKENDS  4       // Max number of backends compared by benchmark
+#define MAX_FIELD_SETTINGS  64      // Max number of --set arguments
+#define MAX_GPIO_STEPS      1024    // Max number of GPIO steps in --gpio argument or line
+#define MAX_STRESS_WORKERS  64      // Max number of concurrent workers of stress test
+#define METRICS_REFRESH_MS  1000    // Min age of registers re-read for metrics scrape without -W
+#define FOLLOW_FAST_MS      2       // Check interval of ALSA stream state after a PCM device was opened
+#define FOLLOW_FAST_WINDOW_MS 250   // Duration of fast checks after a PCM device was opened
 
 
 //////// Globals variables
-uint16_t regbuf[NUM_REGS] = {0};    // Register buffer
+bool ioTimeout = false;             // A device I/O operation has timed out
+bool ioFailed = false;              // A transfer to the device failed or timed out
+bool residentMode = false;          // Watch, listen, daemon, metrics or follow mode. No I/O watchdog
+volatile sig_atomic_t stopRequested = 0;   // SIGINT/SIGTERM received in resident mode
+bool batchWrites = false;           // Writes are committed at end of batch script or before a read
+volatile sig_atomic_t traceRequested = 0;  // SIGUSR1 received with --trace
 
-struct {    // Configuration values
+struct RunStats {   // Time of phases and counters of closed device contexts (--stats)
+    int64_t     startNs;
+    int64_t     lookupNs;       // Device selection (sysfs lookup)
+    int64_t     openNs;
+    int64_t     stringsNs;      // String descriptors
+    int64_t     renderNs;       // Rendering and output of registers
+    cm6206_stats device;        // Totals of closed contexts
+} runStats;
+cm6206_ctx *statsDevice = NULL; // Open device context counted on exit (--stats)
+
+struct Config {    // Configuration values
     bool    verbose;
     bool    quiet;
+    enum cm6206_format output;  // Format of register output
     bool    cmdPrintAll;
     bool    cmdRead;
     int         reg;
@@ -60,324 +89,779 @@ struct {    // Configuration values
     uint16_t    writeVal;
     uint16_t    mask;
     bool    cmdInit;
+    bool    cmdDumpTrace;   // Print trace of last transfers
+    char    *profileFile;   // Apply profile from file
+    cm6206_setting fieldSettings[MAX_FIELD_SETTINGS];  // Field values set by name (--set)
+    unsigned    numFieldSettings;
+    char    *gpioSteps;     // Drive GPIOs by steps (--gpio, "-" = stream from stdin)
     char    *devicePath;
-} cfg = {0, .mask=0xFFFF};
+    char    *scriptFile;    // Batch commands from file ("-" = stdin)
+    bool    inScript;       // Parsing a line of a batch script or daemon request
+    bool    daemon;         // Run as daemon serving requests on socket
+    int     watchMs;        // Poll interval of watch mode (0 = disabled)
+    int     followMs;       // Check interval of ALSA stream state in follow mode (0 = disabled)
+    char    *alsaCard;      // ALSA card of follow mode (number or directory in /proc/asound, NULL = card of device)
+    bool    listen;         // Print asynchronous input reports (events)
+    char    *socketPath;    // Unix domain socket of daemon
+    char    *shmName;       // Shared memory segment of published registers
+    char    *metricsAddr;   // Serve metrics over HTTP on "[<address>:]<port>"
+    int     timeoutMs;      // I/O deadline (0 = wait forever)
+    int     retries;        // Number of retries of a timed out register read
+    bool    pipeline;       // Queue register read requests before collecting responses
+    int     cacheMaxAgeMs;  // Answer read-only commands from shadow cache if younger (0 = disabled)
+    char    *cacheDir;      // Directory of shadow cache
+    char    *backend;       // Transport backend and parameters (NULL = hidapi)
+    char    *backends[MAX_BENCH_BACKENDS];  // All backends given. The benchmark compares them
+    int     numBackends;
+    int     benchIterations;    // Run latency benchmark with number of iterations (0 = disabled)
+    int     stressSeconds;  // Run stress test for number of seconds (0 = disabled)
+    int     stressRate;     // Target verified writes per second of stress test (0 = unlimited)
+    int     stressWorkers;  // Number of concurrent workers of stress test
+    bool    stats;          // Print transfer counters and phase timing on exit
+    bool    trace;          // Print trace of last transfers on error and on SIGUSR1
+} cfg = {0, .mask=0xFFFF, .timeoutMs=CM6206_DEFAULT_TIMEOUT_MS, .retries=CM6206_DEFAULT_RETRIES, .cacheDir=DEFAULT_CACHE_DIR, .stressWorkers=1};
+
+#define MAX_SCRIPT_ARGS 64  // Max number of arguments in a batch script line
+#define MAX_DEVICES     64  // Max number of devices handled in parallel
+#define DEFAULT_SOCKET_PATH "/run/cm6206ctl.sock"
+
+
+//////// I/O deadline
+
+// Milliseconds from monotonic clock
+int64_t monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Nanoseconds from monotonic clock
+int64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void watchdogHandler(int signum) {
+    (void)signum;
+    static const char msg[] = "cm6206ctl: USB device did not respond within deadline\n";
+    if(write(STDERR_FILENO, msg, sizeof(msg)-1)) {}
+    _exit(EXIT_TIMEOUT);
+}
+
+// Terminate process if operations without timeout support (open, write) exceed the deadline
+// Call with 0 to stop the watchdog. Not used in resident modes, which must not exit on a stalled
+// device. There the deadlines of the transports apply (kernel and libusb) and a failed transfer
+// is handled as lost device (see deviceLost)
+void watchdog(int timeoutMs) {
+    static bool installed = false;
+    if(residentMode)    return;
+    if(!installed && timeoutMs) {
+        signal(SIGALRM, watchdogHandler);
+        installed = true;
+    }
+    struct itimerval timer = {.it_value = {timeoutMs/1000, (timeoutMs%1000)*1000}};
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// I/O guard of device context (see cm6206_set_io_guard)
+void watchdogGuard(void *user, int timeoutMs) {
+    (void)user;
+    watchdog(timeoutMs);
+}
+
+
+//////// Device selection
+// Devices are selected by hidapi path, USB port topology or serial number. The selection is resolved
+// from sysfs without enumerating the HID bus, and the resolved port is remembered in the cache
+// directory. A remembered port is re-validated with a few sysfs reads before it is used.
+
+// Identity of a USB device. Resolved from sysfs without any USB transfers
+struct DeviceId {
+    char    path[64];       // hidapi device path (bus:address:interface)
+    char    serial[64];     // Serial number (empty if none)
+    char    topology[32];   // USB port topology (e.g. "1-1.4")
+};
+
+struct DeviceId devid;          // Identity of the selected device
+bool devidValid = false;
+
+// Read attribute from sysfs directory into string without trailing newline. Returns 0 on success
+int readSysfsString(const char *dir, const char *attr, char *buf, size_t size) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s/%s", dir, attr);
+    FILE *file = fopen(filename, "r");
+    if(!file)   return -1;
+    if(!fgets(buf, size, file))     buf[0] = '\0';
+    fclose(file);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// Read identity of CM6206 device at USB port topology. Returns 0 on success, -1 if no CM6206 device
+int readDeviceId(const char *topology, struct DeviceId *id) {
+    char devdir[512], str[64];
+    if(topology[0] == '.' || strchr(topology, ':') || strchr(topology, '/'))    return -1;  // Not a device
+    snprintf(devdir, sizeof(devdir), "%s/%s", SYSFS_USB_DEVICES, topology);
+    if(readSysfsString(devdir, "idVendor", str, sizeof(str)) < 0 || strtol(str, NULL, 16) != CM6206_VENDOR_ID)    return -1;
+    if(readSysfsString(devdir, "idProduct", str, sizeof(str)) < 0 || strtol(str, NULL, 16) != CM6206_PRODUCT_ID)  return -1;
+    if(readSysfsString(devdir, "busnum", str, sizeof(str)) < 0)     return -1;
+    unsigned devbus = strtol(str, NULL, 10);
+    if(readSysfsString(devdir, "devnum", str, sizeof(str)) < 0)     return -1;
+    unsigned devaddr = strtol(str, NULL, 10);
+    memset(id, 0, sizeof(*id));
+    snprintf(id->path, sizeof(id->path), "%04x:%04x:%02x", devbus, devaddr, HID_INTERFACE);
+    readSysfsString(devdir, "serial", id->serial, sizeof(id->serial));
+    snprintf(id->topology, sizeof(id->topology), "%.31s", topology);
+    return 0;
+}
+
+// Does device match selection? Selection is a hidapi path, a USB port topology or a serial number
+// NULL selects any device
+bool deviceMatches(const char *selection, const struct DeviceId *id) {
+    unsigned bus, addr, iface, devbus, devaddr;
+    if(!selection)  return true;
+    if(sscanf(selection, "%x:%x:%x", &bus, &addr, &iface) == 3) {
+        return sscanf(id->path, "%x:%x", &devbus, &devaddr) == 2 && bus == devbus && addr == devaddr;
+    }
+    return strcmp(selection, id->topology) == 0 || (id->serial[0] && strcmp(selection, id->serial) == 0);
+}
+
+// Name of file in cache directory remembering the USB port of a selection
+void resolveFileName(const char *selection, char *buf, size_t size) {
+    snprintf(buf, size, "%.54s.port", selection ? selection : "default");
+    for(char *p = buf; *p; p++) {
+        if(*p == '/' || *p == ':')  *p = '_';
+    }
+}
+
+// Remember USB port of selection. Replaced atomically
+void resolveStore(const char *selection, const char *topology) {
+    char name[64], filename[256], tmpname[280];
+    resolveFileName(selection, name, sizeof(name));
+    snprintf(filename, sizeof(filename), "%s/%s", cfg.cacheDir, name);
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid());
+    mkdir(cfg.cacheDir, 0755);
+    FILE *file = fopen(tmpname, "w");
+    if(!file)   return;     // Remembering is optional
+    bool ok = fprintf(file, "%s\n", topology) > 0;
+    if(fclose(file) != 0 || !ok || rename(tmpname, filename) < 0)   unlink(tmpname);
+}
+
+// Resolve identity of selected device (see deviceMatches)
+// Returns 0 on success, -1 if not found
+int lookupDeviceId(const char *selection, struct DeviceId *id) {
+    char name[64], topology[32];
+    resolveFileName(selection, name, sizeof(name));
+    bool found = readSysfsString(cfg.cacheDir, name, topology, sizeof(topology)) == 0
+                 && readDeviceId(topology, id) == 0 && deviceMatches(selection, id);  // Remembered port is still valid
+    if(!found) {
+        DIR *dir = opendir(SYSFS_USB_DEVICES);
+        if(!dir)    return -1;
+        struct dirent *de;
+        while(!found && (de = readdir(dir))) {
+            found = readDeviceId(de->d_name, id) == 0 && deviceMatches(selection, id);
+        }
+        closedir(dir);
+        if(!found)  return -1;
+        resolveStore(selection, id->topology);
+    }
+    unsigned bus, addr, iface;
+    if(selection && sscanf(selection, "%x:%x:%x", &bus, &addr, &iface) == 3) {
+        snprintf(id->path, sizeof(id->path), "%04x:%04x:%02x", bus, addr, iface);  // Keep selected interface
+    }
+    return 0;
+}
+
+
+// Resolve identity of selected device into devid. Emulated devices have no identity
+void selectDevice(void) {
+    int64_t start = monotonicNs();
+    bool emulated = cfg.backend && strncmp(cfg.backend, "emu", 3) == 0;
+    devidValid = !emulated && lookupDeviceId(cfg.devicePath, &devid) == 0;
+    runStats.lookupNs += monotonicNs() - start;
+}
 
 
 //////// USB device information printout
+// Devices are listed and described from sysfs, which holds the string descriptors read by the
+// kernel at enumeration. hid_enumerate() opens every device and is only used without sysfs.
+
+int compareDeviceId(const void *a, const void *b) {
+    return strcmp(((const struct DeviceId *)a)->path, ((const struct DeviceId *)b)->path);
+}
+
+// List CM6206 devices from sysfs ordered by path. Returns number of devices, -1 if sysfs is not available
+int listDevices(struct DeviceId *ids, int maxids) {
+    DIR *dir = opendir(SYSFS_USB_DEVICES);
+    if(!dir)    return -1;
+    int count = 0;
+    struct dirent *de;
+    while(count < maxids && (de = readdir(dir))) {
+        if(readDeviceId(de->d_name, &ids[count]) == 0)  count++;
+    }
+    closedir(dir);
+    qsort(ids, count, sizeof(ids[0]), compareDeviceId);
+    return count;
+}
+
+// Enumerate HID interfaces of CM6206 devices with hidapi. Other interfaces are dropped
+struct hid_device_info *enumerateDevices(void) {
+    struct hid_device_info *hid_devs = hid_enumerate(CM6206_VENDOR_ID, CM6206_PRODUCT_ID);
+    struct hid_device_info **link = &hid_devs;
+    while(*link) {
+        struct hid_device_info *hd = *link;
+        if(hd->interface_number == HID_INTERFACE || hd->interface_number < 0) {     // -1 = unknown
+            link = &hd->next;
+            continue;
+        }
+        *link = hd->next;
+        hd->next = NULL;
+        hid_free_enumeration(hd);
+    }
+    return hid_devs;
+}
 
 void printAvailableUSBDevices(void) {
+    struct DeviceId ids[MAX_DEVICES];
+    char devdir[512], manuf[64], product[64];
     printf("Devices found:\n");
-    printf("<device>, <Manufacturer>, <Product>, <Serial Number>\n");
-    struct hid_device_info *hid_devs = hid_enumerate(USB_VENDOR_ID, USB_PRODUCT_ID);
-    if(hid_devs == NULL) {
-        printf(" Found no USB devices with ID %04x:%04x\n", USB_VENDOR_ID, USB_PRODUCT_ID);
-        return;
+    int count = listDevices(ids, MAX_DEVICES);
+    if(count >= 0) {
+        printf("<device>, <Manufacturer>, <Product>, <Serial Number>, <Port>\n");
+        for(int n=0; n<count; n++) {
+            snprintf(devdir, sizeof(devdir), "%s/%s", SYSFS_USB_DEVICES, ids[n].topology);
+            if(readSysfsString(devdir, "manufacturer", manuf, sizeof(manuf)) < 0)   strcpy(manuf, "(null)");
+            if(readSysfsString(devdir, "product", product, sizeof(product)) < 0)    strcpy(product, "(null)");
+            printf("%s, %s, %s, %s, %s\n", ids[n].path, manuf, product, ids[n].serial[0] ? ids[n].serial : "(null)", ids[n].topology);
+        }
+    } else {
+        printf("<device>, <Manufacturer>, <Product>, <Serial Number>\n");
+        struct hid_device_info *hid_devs = enumerateDevices();
+        for(struct hid_device_info *hd = hid_devs; hd; hd = hd->next, count++) {
+            printf("%s, %ls, %ls, %ls\n",
+                hd->path, hd->manufacturer_string, hd->product_string, hd->serial_number);
+        }
+        hid_free_enumeration(hid_devs);
     }
-    struct hid_device_info *hd = hid_devs;
-    while(hd) {
-        printf("%s, %ls, %ls, %ls\n",
-            hd->path, hd->manufacturer_string, hd->product_string, hd->serial_number);
-        hd = hd->next;
+    if(count <= 0) {
+        printf(" Found no USB devices with ID %04x:%04x\n", CM6206_VENDOR_ID, CM6206_PRODUCT_ID);
     }
-    hid_free_enumeration(hid_devs);
 }
 
-void printUSBDeviceInfo(hid_device *hid_dev) {
+// Print manufacturer, product and serial number. Taken from sysfs if the device is known there,
+// so no string descriptors are transferred
+void printUSBDeviceInfo(cm6206_ctx *ctx) {
     #define BUFLEN (64)
+    if(devidValid) {
+        char devdir[512], manuf[BUFLEN], product[BUFLEN];
+        snprintf(devdir, sizeof(devdir), "%s/%s", SYSFS_USB_DEVICES, devid.topology);
+        if(readSysfsString(devdir, "manufacturer", manuf, sizeof(manuf)) < 0)   strcpy(manuf, "(null)");
+        if(readSysfsString(devdir, "product", product, sizeof(product)) < 0)    strcpy(product, "(null)");
+        printf("Device: %s, %s, %s\n", manuf, product, devid.serial[0] ? devid.serial : "(null)");
+        return;
+    }
     wchar_t strManuf[BUFLEN] = L"(null)";
     wchar_t strProduct[BUFLEN] = L"(null)";
     wchar_t strSerial[BUFLEN] = L"(null)";
 
-    hid_get_manufacturer_string(hid_dev, strManuf, BUFLEN);
-    hid_get_product_string(hid_dev, strProduct, BUFLEN);
-    hid_get_serial_number_string(hid_dev, strSerial, BUFLEN);
+    cm6206_get_strings(ctx, strManuf, strProduct, strSerial, BUFLEN);
 
     printf("Device: %ls, %ls, %ls\n", strManuf, strProduct, strSerial);
 }
 
 
-//////// CM6206 specific USB read/write functions
-
-int cm6206_read(hid_device *dev, uint8_t regnum, uint16_t *value) {
-    uint8_t buf[5] = {0x00, // USB Report ID
-            0x30,           // 0x30 = read, 0x20 = write
-            0x00,           // DATAL
-            0x00,           // DATAH
-            regnum          // Register address
-    };
+//////// Register shadow cache
 
-    if (hid_write(dev, buf, sizeof(buf)) != sizeof(buf))
-        return -1;
+// Shadow cache entry as stored in file
+#define CACHE_MAGIC     0x36324d43  // "CM26"
+struct RegCache {
+    uint32_t    magic;
+    uint32_t    generation;     // Incremented on every update of the entry
+    int64_t     timestampMs;    // Time of sample (monotonic clock)
+    struct DeviceId id;
+    uint16_t    valid;          // Bitmask of valid registers
+    uint16_t    regs[CM6206_NUM_REGS];
+};
 
-    if (hid_read(dev, buf, sizeof(buf)) != 3)
-        return -2;
+bool cacheInvalidated = false;  // Cache entry has been invalidated by a write since it was stored
 
-    if ((buf[0] & 0xe0) != 0x20)    // No register data in the input report
-        return -3;
+void cacheFileName(char *buf, size_t size) {
+    snprintf(buf, size, "%s/%s.cache", cfg.cacheDir, devid.topology);
+}
 
-    *value = (((uint16_t)buf[2]) << 8) | buf[1];
+// Load cache entry of device. Returns 0 if a matching entry was found
+int cacheLoad(struct RegCache *entry) {
+    char filename[256];
+    cacheFileName(filename, sizeof(filename));
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)  return -1;
+    ssize_t len = read(fd, entry, sizeof(*entry));
+    close(fd);
+    if(len != sizeof(*entry) || entry->magic != CACHE_MAGIC)    return -1;
+    if(strcmp(entry->id.path, devid.path) != 0 || strcmp(entry->id.serial, devid.serial) != 0)
+        return -1;  // Different device at same port
     return 0;
 }
 
-int cm6206_write(hid_device *dev, uint8_t regnum, uint16_t value) {
-    uint8_t buf[5] = {0x00, // USB Report ID
-            0x20,           // 0x30 = read, 0x20 = write
-            (value & 0xff), // DATAL
-            (value >> 8),   // DATAH
-            regnum          // Register address
-    };
+// Store registers as cache entry of device. Entry is replaced atomically
+// The next write invalidates the entry again
+void cacheStore(const uint16_t *regs, unsigned valid) {
+    if(!devidValid)     return;
+    cacheInvalidated = false;
+    struct RegCache entry;
+    uint32_t generation = (cacheLoad(&entry) == 0) ? entry.generation : 0;
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = CACHE_MAGIC;
+    entry.generation = generation + 1;
+    entry.timestampMs = monotonicMs();
+    entry.id = devid;
+    entry.valid = valid;
+    memcpy(entry.regs, regs, sizeof(entry.regs));
 
-    if (hid_write(dev, buf, sizeof(buf)) != sizeof(buf))
-        return -1;
+    char filename[256], tmpname[280];
+    cacheFileName(filename, sizeof(filename));
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid());
+    mkdir(cfg.cacheDir, 0755);
+    int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0)  return;     // Cache is optional
+    bool ok = write(fd, &entry, sizeof(entry)) == sizeof(entry);
+    close(fd);
+    if(!ok || rename(tmpname, filename) < 0)    unlink(tmpname);
+}
 
-    return 0;
+// Invalidate cache entry of device before it is written. Done once after each store
+// Used as write hook of the device context (see cm6206_set_write_hook)
+void cacheInvalidate(void *user, unsigned reg, uint16_t value) {
+    (void)user; (void)reg; (void)value;
+    if(!devidValid || cacheInvalidated)     return;
+    struct RegCache entry;
+    if(cacheLoad(&entry) == 0)  cacheStore(entry.regs, 0);
+    cacheInvalidated = true;
+}
+
+// Store registers of device context which are in sync with device
+void cacheStoreContext(cm6206_ctx *ctx) {
+    unsigned valid;
+    const uint16_t *regs = cm6206_shadow(ctx, &valid);
+    if(valid)   cacheStore(regs, valid);
+}
+
+// Try to answer read-only command from cache. Returns context without device holding the cached
+// registers, or NULL if the device must be opened
+cm6206_ctx *cacheAnswer(void) {
+    if(!devidValid || cfg.cmdWrite || cfg.cmdInit || cfg.profileFile || cfg.numFieldSettings || cfg.scriptFile || cfg.daemon
+       || cfg.metricsAddr || cfg.gpioSteps || cfg.followMs)
+        return NULL;
+    unsigned needed = (cfg.cmdPrintAll ? CM6206_ALL_REGS : 0) | (cfg.cmdRead ? 1u << cfg.reg : 0);
+    struct RegCache entry;
+    if(cacheLoad(&entry) < 0 || monotonicMs() - entry.timestampMs > cfg.cacheMaxAgeMs || (entry.valid & needed) != needed)
+        return NULL;
+    cm6206_ctx *ctx = cm6206_create();
+    if(!ctx)    return NULL;
+    cm6206_set_shadow(ctx, entry.regs, entry.valid);
+    if(!cfg.quiet) { printf("Device: %s (cached, generation %u)\n", devid.path, entry.generation); }
+    return ctx;
+}
+
+
+//////// Shared memory publication (--shm)
+// In watch and daemon mode the registers are published in a shared memory segment after every poll
+// and request. Other commands with --shm are answered from the segment if they only read.
+
+cm6206_shm *shmPublisher = NULL;
+
+void shmOpen(void) {
+    int res = cm6206_shm_create(cfg.shmName, &shmPublisher);
+    if(res == CM6206_ERR_OPEN) { err(EXIT_FAILURE, "Could not create shared memory %s", cfg.shmName); }
+    if(res < 0) { errx(EXIT_FAILURE, "Could not create shared memory %s (%s)", cfg.shmName, cm6206_strerror(res)); }
+}
+
+// Publish registers of device context which are in sync with device (none if there is no device)
+void shmPublish(cm6206_ctx *ctx) {
+    static const uint16_t none[CM6206_NUM_REGS];
+    if(!shmPublisher)   return;
+    unsigned valid = 0;
+    const uint16_t *regs = ctx ? cm6206_shadow(ctx, &valid) : none;
+    cm6206_shm_publish(shmPublisher, regs, valid, 0);
 }
 
+// Publish that the registers are not available any more and close segment
+void shmClose(void) {
+    if(!shmPublisher)   return;
+    shmPublish(NULL);
+    cm6206_shm_close(shmPublisher);
+    shmPublisher = NULL;
+}
 
-// Refresh global register buffer (regbuf)
-void readAllRegisters(hid_device *hid_dev) {
-    for(int n=0; n<NUM_REGS; n++) {
-        if (cm6206_read(hid_dev, n, &regbuf[n]) < 0)
-            err(EXIT_FAILURE, "read: %ls, reg: %d", hid_error(hid_dev), n);
+// Try to answer read-only command from shared memory. Returns context without device holding the
+// published registers, or NULL if the device must be opened. The registers of a publisher which
+// ended without closing the segment (e.g. killed) are not used
+cm6206_ctx *shmAnswer(void) {
+    if(cfg.cmdWrite || cfg.cmdInit || cfg.profileFile || cfg.numFieldSettings || cfg.scriptFile || cfg.daemon
+       || cfg.watchMs || cfg.listen || cfg.metricsAddr || cfg.gpioSteps || cfg.followMs)
+        return NULL;
+    unsigned needed = (cfg.cmdPrintAll ? CM6206_ALL_REGS : 0) | (cfg.cmdRead ? 1u << cfg.reg : 0);
+    cm6206_shm *shm;
+    if(cm6206_shm_open(cfg.shmName, &shm) < 0)  return NULL;
+    cm6206_snapshot snap;
+    int res = cm6206_shm_read(shm, &snap);
+    cm6206_shm_close(shm);
+    if(res < 0 || (snap.valid & needed) != needed)  return NULL;
+    if(kill(snap.pid, 0) < 0 && errno == ESRCH)     return NULL;    // Publisher is gone
+    cm6206_ctx *ctx = cm6206_create();
+    if(!ctx)    return NULL;
+    cm6206_set_shadow(ctx, snap.regs, snap.valid);
+    if(!cfg.quiet) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int64_t ageMs = ((int64_t)ts.tv_sec*1000000000 + ts.tv_nsec - snap.timestampNs) / 1000000;
+        printf("Device: %s (shared memory, sample %lld ms old)\n", cfg.shmName, (long long)ageMs);
     }
+    return ctx;
 }
 
 
-/////// Printout of registers functions
+//////// Device access
 
-#define ANSI_HEADER "\e[36m"    // Cyan
-#define ANSI_BOLD   "\e[1m"
-#define ANSI_RESET  "\e[0m"
-#define ANSI_TAB    "\e[43G"    // Column number
-#define ANSI_TAB2   "\e[67G"    // Column number
+// Print trace of the last transfers of device context to file descriptor
+void dumpTrace(cm6206_ctx *ctx, int fd) {
+    static cm6206_trace_entry entries[CM6206_TRACE_SIZE];
+    static cm6206_buf traceBuf = {0};
+    unsigned count = cm6206_get_trace(ctx, entries, CM6206_TRACE_SIZE);
+    bool json = cfg.output == CM6206_FORMAT_JSON;
+    if(!json)   cm6206_buf_printf(&traceBuf, "Trace of last %u transfers (time, delta, duration, direction, report, result):\n", count);
+    cm6206_render_trace(&traceBuf, entries, count, json ? CM6206_FORMAT_JSON : CM6206_FORMAT_TEXT);
+    fflush(stdout); fflush(stderr);     // Keep order with other output
+    if(cm6206_buf_write(&traceBuf, fd) == CM6206_ERR_NOMEM) { warnx("Trace lost: out of memory"); }
+}
 
-// Tuple for list of value/label pairs. Last tuple in list must have value -1 and a default label
-typedef struct { int val; const char *label; } ValLabel;
+// Dump trace if requested by SIGUSR1
+void checkTraceRequest(cm6206_ctx *ctx) {
+    if(!traceRequested || !ctx)     return;
+    traceRequested = 0;
+    dumpTrace(ctx, STDERR_FILENO);
+}
 
-// Print a header for the provided register
-void print_reg_header(unsigned regnum, uint16_t regval) {
-    const char *HILIGHT = (regval == REG_DEFAULT[regnum]) ? ANSI_RESET: ANSI_BOLD;
-    printf("%s== REG%u == %s", ANSI_HEADER, regnum, ANSI_RESET);
-    printf("\t\t%sRaw value: 0x%04X%s\t\t (Reset value: 0x%04X)\n",
-        HILIGHT, regval, ANSI_RESET, REG_DEFAULT[regnum]);
-}
-
-// Print value of bit in register with provided label
-void print_reg_bit_special(unsigned regnum, uint16_t regval, unsigned bit, const char *label, const char *valuetxt) {
-    int isdefault = (regval>>bit & 1) == (REG_DEFAULT[regnum]>>bit & 1);
-    const char *HILIGHT = (isdefault ? "" : ANSI_BOLD);
-    printf("%s[%02u] %s%s %s%s\n", HILIGHT, bit, label, ANSI_TAB, valuetxt, ANSI_RESET);
-}
-
-// Print value of bit in register with provided on/off labels
-void print_reg_bit_txt(unsigned regnum, uint16_t regval, unsigned bit, const char *label, const char *ontxt, const char* offtxt) {
-    char strbuf[128];
-    const char *statetxt = ((regval>>bit & 1) ? ontxt : offtxt);
-    sprintf(strbuf, "%s", statetxt);
-    if(cfg.verbose) {     // Verbose values
-        sprintf(strbuf+strlen(strbuf), "%s {0=\"%s\", 1=\"%s\"}", ANSI_TAB2, offtxt, ontxt);
-    }
-    print_reg_bit_special(regnum, regval, bit, label, strbuf);
-}
-
-// Print value of bit in register with default on/off labels
-void print_reg_bit_def(unsigned regnum, uint16_t regval, unsigned bit, const char *label) {
-    print_reg_bit_txt(regnum, regval, bit, label, "Yes", "No");
-}
-
-// Print value of bit in register with provided label
-void print_reg_bit_range(unsigned regnum, uint16_t regval, unsigned firstbit, unsigned numbits, const char *label, const char *valuetxt) {
-    assert(numbits > 1);
-    assert(firstbit + numbits <= 16);
-    unsigned mask = 0xFFFF >> (16-numbits);
-    int isdefault = (regval>>firstbit & mask) == (REG_DEFAULT[regnum]>>firstbit & mask);
-    const char *HILIGHT = (isdefault ? "" : ANSI_BOLD);
-    printf("%s[%02u:%02u] %s%s %s%s\n", HILIGHT, firstbit+numbits-1, firstbit, label, ANSI_TAB, valuetxt, ANSI_RESET);
-}
-
-// Print value of bit in register with provided labels
-void print_reg_bit_range_label(unsigned regnum, uint16_t regval, unsigned firstbit, unsigned numbits, const char *label, const ValLabel *labels) {
-    char strbuf[128];
-    const char *valuetxt = NULL;
-    int n=0;
-    unsigned mask = 0xFFFF >> (16-numbits);
-    while (labels[n].val >= 0) {
-        if(labels[n].val == (regval>>firstbit & mask)) { // Does values match
-            valuetxt = labels[n].label;
-        }
-        n++;
-    }
-    if(!valuetxt)   valuetxt = labels[n].label;     // Choose -1 as default label
-    sprintf(strbuf, "%s", valuetxt);
-    if(cfg.verbose) {     // Verbose values
-        sprintf(strbuf+strlen(strbuf), "%s {", ANSI_TAB2);
-        n=0;
-        while (labels[n].val >= 0) {
-            sprintf(strbuf+strlen(strbuf), "%u=\"%s\", ", labels[n].val, labels[n].label);
-            n++;
-        }
-        sprintf(strbuf+(strlen(strbuf)-2), "}");
-    }
-    print_reg_bit_range(regnum, regval, firstbit, numbits, label, strbuf);
-}
-
-void print_cm6202_reg0(uint16_t val) {
-    char sbuf[8];
-    static const ValLabel SPDIF_OUT_HZ[] = {
-        {0, "44.1 kHz"},    // Marked as reserved, but seems to work!
-        {2, "48 kHz"},
-        {3, "32 kHz"},      // Marked as reserved, but seems to work!
-        {6, "96 kHz"},
-        {-1, "Reserved"}
-    };
-    print_reg_bit_txt(0, val, 15, "DMA Master", "SPDIF Out", "DAC");
-    print_reg_bit_range_label(0, val, 12, 3, "SPDIF Out sample rate", SPDIF_OUT_HZ);
-    sprintf(sbuf, "%u", (val>>4 & 0xFF));
-    print_reg_bit_range(0, val, 4, 8, "Category code", sbuf);
-    print_reg_bit_txt(0, val, 3, "Emphasis", "CD_Type", "None");
-    print_reg_bit_txt(0, val, 2, "Copyright", "Not Asserted", "Asserted");
-    print_reg_bit_txt(0, val, 1, "Non-audio", "non-PCM (e.g. AC3)", "PCM");
-    print_reg_bit_txt(0, val, 0, "Professional/Consumer", "Professional", "Consumer");
-}
-
-void print_cm6202_reg1(uint16_t val) {
-    print_reg_bit_special(1, val, 15, "<Reserved>", "");
-    print_reg_bit_txt(1, val, 14, "SEL Clk (test)", "22.58 MHz", "24.576 MHz");
-    print_reg_bit_def(1, val, 13, "PLL binary search Enable");
-    print_reg_bit_def(1, val, 12, "Soft Mute Enable");
-    print_reg_bit_def(1, val, 11, "GPIO4 Out Status");
-    print_reg_bit_def(1, val, 10, "GPIO4 Out Enable");
-    print_reg_bit_def(1, val, 9, "GPIO3 Out Status");
-    print_reg_bit_def(1, val, 8, "GPIO3 Out Enable");
-    print_reg_bit_def(1, val, 7, "GPIO2 Out Status");
-    print_reg_bit_def(1, val, 6, "GPIO2 Out Enable");
-    print_reg_bit_def(1, val, 5, "GPIO1 Out Status");
-    print_reg_bit_def(1, val, 4, "GPIO1 Out Enable");
-    print_reg_bit_def(1, val, 3, "SPDIF Out Valid");
-    print_reg_bit_def(1, val, 2, "SPDIF Loop-back Enable");
-    print_reg_bit_def(1, val, 1, "SPDIF Out Disable");
-    print_reg_bit_def(1, val, 0, "SPDIF In Mix Enable");
-}
-
-void print_cm6202_reg2(uint16_t val) {
-    print_reg_bit_def(2, val, 15, "Driver On");
-    ValLabel HEADPHONE_SOURCES[] = {
-        {0, "Side"},
-        {1, "Rear"},
-        {2, "Center/Subwoofer"},
-        {3, "Front"},
-        {-1,  "<Reserved>"}
-    };
-    print_reg_bit_range_label(2, val, 13, 2, "Headphone Source channels", HEADPHONE_SOURCES);
-    print_reg_bit_def(2, val, 12, "Mute Headphone Right");
-    print_reg_bit_def(2, val, 11, "Mute Headphone Left");
-    print_reg_bit_def(2, val, 10, "Mute Rear Surround Right");
-    print_reg_bit_def(2, val, 9, "Mute Rear Surround Left");
-    print_reg_bit_def(2, val, 8, "Mute Side Surround Right");
-    print_reg_bit_def(2, val, 7, "Mute Side Surround Left");
-    print_reg_bit_def(2, val, 6, "Mute Subwoofer");
-    print_reg_bit_def(2, val, 5, "Mute Center");
-    print_reg_bit_def(2, val, 4, "Mute Front Right");
-    print_reg_bit_def(2, val, 3, "Mute Front Left");
-    print_reg_bit_def(2, val, 2, "BTL mode enable");
-    ValLabel MCU_CLK_FREQS[] = {
-        {0, "1.5 MHz"},
-        {1, "3 MHz"},
-        {-1, "<Reserved>"}
-    };
-    print_reg_bit_range_label(2, val, 0, 2, "MCU Clock Frequency", MCU_CLK_FREQS);
-}
-
-void print_cm6202_reg3(uint16_t val) {
-    char sbuf[8];
-    print_reg_bit_range(3, val, 14, 2, "<Reserved>", "");
-    sprintf(sbuf, "%u", (val>>11 & 7));
-    print_reg_bit_range(3, val, 11, 2, "Sensitivity to FLY tuner volume", sbuf);
-    print_reg_bit_txt(3, val, 10, "Microphone bias voltage", "2.25 V", "4.5 V");
-    // Note:  Bit 9 is inverted compared to the description in the datasheet.
-    //          However tests have proven the datasheet wrong...
-    print_reg_bit_txt(3, val, 9, "Mix MIC/Line In to", "Front Out Only", "All 8 Channels");
-    static const ValLabel SPDIF_IN_HZ[] = {
-        {0, "44.1 kHz"},    // Marked as reserved, but seems to work!
-        {2, "48 kHz"},
-        {3, "32 kHz"},      // Marked as reserved, but seems to work!
-        {-1, "Reserved"}
-    };
-    print_reg_bit_range_label(3, val, 7, 2, "SPDIF In sample rate", SPDIF_IN_HZ);
-    print_reg_bit_txt(3, val, 6, "Package size", "48 pins", "100 pins");
-    print_reg_bit_def(3, val, 5, "Front Out Enable");
-    print_reg_bit_def(3, val, 4, "Rear Out Enable");
-    print_reg_bit_def(3, val, 3, "Center Out Enable");
-    print_reg_bit_def(3, val, 2, "Line Out Enable");
-    print_reg_bit_def(3, val, 1, "Headphone Out Enable");
-    print_reg_bit_def(3, val, 0, "SPDIF In can be recorded");
-}
-
-void print_cm6202_reg4(uint16_t val) {
-    print_reg_bit_def(4, val, 15, "GPIO12 Out Status");
-    print_reg_bit_def(4, val, 14, "GPIO12 Out Enable");
-    print_reg_bit_def(4, val, 13, "GPIO11 Out Status");
-    print_reg_bit_def(4, val, 12, "GPIO11 Out Enable");
-    print_reg_bit_def(4, val, 11, "GPIO10 Out Status");
-    print_reg_bit_def(4, val, 10, "GPIO10 Out Enable");
-    print_reg_bit_def(4, val, 9, "GPIO9 Out Status");
-    print_reg_bit_def(4, val, 8, "GPIO9 Out Enable");
-    print_reg_bit_def(4, val, 7, "GPIO8 Out Status");
-    print_reg_bit_def(4, val, 6, "GPIO8 Out Enable");
-    print_reg_bit_def(4, val, 5, "GPIO7 Out Status");
-    print_reg_bit_def(4, val, 4, "GPIO7 Out Enable");
-    print_reg_bit_def(4, val, 3, "GPIO6 Out Status");
-    print_reg_bit_def(4, val, 2, "GPIO6 Out Enable");
-    print_reg_bit_def(4, val, 1, "GPIO5 Out Enable");
-    print_reg_bit_def(4, val, 0, "GPIO5 Out Status");
-}
-
-void print_cm6202_reg5(uint16_t val) {
-    print_reg_bit_range(5, val, 14, 2, "<Reserved>", "");
-    print_reg_bit_def(5, val, 13, "DAC Not Reset");
-    print_reg_bit_def(5, val, 12, "ADC Not Reset");
-    print_reg_bit_def(5, val, 11, "ADC to SPDIF Out");
-    ValLabel SPDIF_OUT_CHANNELS[] = {
-        {0, "Front"},
-        {1, "Side"},
-        {2, "Center"},
-        {3, "Rear"},
-        {-1,  "<Reserved>"}
-    };
-    print_reg_bit_range_label(5, val, 9, 2, "SPDIF Out select", SPDIF_OUT_CHANNELS);
-    print_reg_bit_txt(5, val, 8, "USB/CODEC Mode", "CODEC", "USB");
-    print_reg_bit_def(5, val, 7, "DAC high pass filter");
-    print_reg_bit_def(5, val, 6, "Loopback ADC to Rear DAC");
-    print_reg_bit_def(5, val, 5, "Loopback ADC to Center DAC");
-    print_reg_bit_def(5, val, 4, "Loopback ADC to Side DAC");
-    print_reg_bit_def(5, val, 3, "Loopback ADC to Front DAC");
-    ValLabel AD_FILTER_SOURCES[] = {
-        {0, "Normal"},
-        {4, "Front"},
-        {5, "Side"},
-        {6, "Center"},
-        {7, "Rear"},
-        {-1,  "<Reserved>"}
-    };
-    print_reg_bit_range_label(5, val, 0, 3, "Input source to AD digital filter", AD_FILTER_SOURCES);
-}
-
-void print_cm6202_regs(void) {
-    for(int n=0; n<NUM_REGS; n++) {
-        print_reg_header(n, regbuf[n]);
-        if(!cfg.quiet) {
-            switch(n) {
-                case 0: print_cm6202_reg0(regbuf[n]); break;
-                case 1: print_cm6202_reg1(regbuf[n]); break;
-                case 2: print_cm6202_reg2(regbuf[n]); break;
-                case 3: print_cm6202_reg3(regbuf[n]); break;
-                case 4: print_cm6202_reg4(regbuf[n]); break;
-                case 5: print_cm6202_reg5(regbuf[n]); break;
-                default: assert(0);
+void traceSignalHandler(int signum) {
+    (void)signum;
+    traceRequested = 1;
+}
+
+// Report error of device context. Returns -1
+int deviceError(cm6206_ctx *ctx, int res) {
+    fflush(stdout);     // Keep order with other output
+    warnx("%s", cm6206_error(ctx));
+    if(cfg.trace)   dumpTrace(ctx, STDERR_FILENO);
+    if(res == CM6206_ERR_TIMEOUT)   ioTimeout = true;
+    if(res == CM6206_ERR_TIMEOUT || res == CM6206_ERR_READ || res == CM6206_ERR_WRITE)  ioFailed = true;
+    return -1;
+}
+
+// Make sure registers in mask are in sync with device. Only reads from device if needed
+int syncRegisters(cm6206_ctx *ctx, unsigned mask) {
+    int res = cm6206_sync(ctx, mask);
+    return (res < 0) ? deviceError(ctx, res) : 0;
+}
+
+
+//////// Statistics (--stats)
+
+// Add counters to totals
+void statsAdd(cm6206_stats *to, const cm6206_stats *s) {
+    to->reportsWritten += s->reportsWritten;
+    to->reportsRead += s->reportsRead;
+    to->bytesWritten += s->bytesWritten;
+    to->bytesRead += s->bytesRead;
+    to->retries += s->retries;
+    to->timeouts += s->timeouts;
+    to->errors += s->errors;
+    to->readNs += s->readNs;
+    to->writeNs += s->writeNs;
+    to->verifyNs += s->verifyNs;
+    for(int b=0; b<CM6206_LATENCY_BUCKETS; b++) {
+        to->readLatency[b] += s->readLatency[b];
+        to->writeLatency[b] += s->writeLatency[b];
+    }
+}
+
+// Add counters of context to totals
+void statsCollect(cm6206_ctx *ctx) {
+    cm6206_stats s;
+    cm6206_get_stats(ctx, &s);
+    cm6206_reset_stats(ctx);
+    statsAdd(&runStats.device, &s);
+}
+
+// Print statistics to stderr. Registered with atexit() by --stats
+void printStats(void) {
+    if(statsDevice)     statsCollect(statsDevice);
+    const cm6206_stats *d = &runStats.device;
+    static const char *const phaseNames[] = {"lookup", "open", "strings", "read", "write", "verify", "render", "total"};
+    const int64_t phases[] = {runStats.lookupNs, runStats.openNs, runStats.stringsNs, d->readNs, d->writeNs,
+        d->verifyNs, runStats.renderNs, monotonicNs() - runStats.startNs};
+    fflush(stdout);
+    if(cfg.output == CM6206_FORMAT_JSON) {
+        fprintf(stderr, "{\"reports_written\":%llu,\"bytes_written\":%llu,\"reports_read\":%llu,\"bytes_read\":%llu,"
+            "\"retries\":%llu,\"timeouts\":%llu,\"errors\":%llu,\"phases\":{",
+            (unsigned long long)d->reportsWritten, (unsigned long long)d->bytesWritten, (unsigned long long)d->reportsRead,
+            (unsigned long long)d->bytesRead, (unsigned long long)d->retries, (unsigned long long)d->timeouts,
+            (unsigned long long)d->errors);
+        for(int n=0; n<8; n++)  fprintf(stderr, "%s\"%s_us\":%.1f", n ? "," : "", phaseNames[n], phases[n]/1e3);
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    fprintf(stderr, "Reports written %10llu (%llu bytes)\n", (unsigned long long)d->reportsWritten, (unsigned long long)d->bytesWritten);
+    fprintf(stderr, "Reports read    %10llu (%llu bytes)\n", (unsigned long long)d->reportsRead, (unsigned long long)d->bytesRead);
+    fprintf(stderr, "Retries         %10llu\n", (unsigned long long)d->retries);
+    fprintf(stderr, "Timeouts        %10llu\n", (unsigned long long)d->timeouts);
+    fprintf(stderr, "Errors          %10llu\n", (unsigned long long)d->errors);
+    for(int n=0; n<8; n++)  fprintf(stderr, "%-12s %13.1f us\n", phaseNames[n], phases[n]/1e3);
+}
+
+// Close device context (NULL = no device). Its counters are kept for --stats
+void closeDevice(cm6206_ctx *ctx) {
+    if(!ctx)    return;
+    statsCollect(ctx);
+    if(ctx == statsDevice)  statsDevice = NULL;
+    cm6206_close(ctx);
+}
+
+
+//////// Register profiles
+
+// Resolve "<field name>=<label or value>" into register setting. Returns 0 on success, -1 on error
+int resolveFieldSetting(const char *assignment, cm6206_setting *setting) {
+    int namelen = strrchr(assignment, '=') ? (int)(strrchr(assignment, '=') - assignment) : 0;
+    switch(cm6206_field_setting(assignment, setting)) {
+        case 0:
+            return 0;
+        case CM6206_ERR_FIELD:
+            warnx("Unknown field \"%.*s\"", namelen, assignment);
+            return -1;
+        case CM6206_ERR_VALUE:
+            warnx("Invalid value \"%s\" for field \"%.*s\"", assignment+namelen+1, namelen, assignment);
+            return -1;
+        case CM6206_ERR_AMBIGUOUS:
+            warnx("Field setting \"%s\" is ambiguous", assignment);
+            return -1;
+        default:
+            warnx("Invalid field setting \"%s\". Use \"<field name>=<value>\"", assignment);
+            return -1;
+    }
+}
+
+// Load profile from file into settings. Each line is "<reg> <value> [<mask>]" (mask defaults to 0xFFFF)
+// or "<field name>=<label or value>". Empty lines and text after '#' are ignored
+// Returns number of settings or -1 on error
+int loadProfile(const char *filename, cm6206_setting *settings, unsigned maxsettings) {
+    FILE *file = fopen(filename, "r");
+    if(!file) {
+        warn("Could not open profile %s", filename);
+        return -1;
+    }
+    char line[256];
+    unsigned linenum = 0;
+    int count = 0;
+    while(fgets(line, sizeof(line), file)) {
+        linenum++;
+        char *comment = strchr(line, '#');
+        if(comment)     *comment = '\0';
+        char *text = line + strspn(line, " \t\r\n");
+        size_t len = strlen(text);
+        while(len && strchr(" \t\r\n", text[len-1]))   text[--len] = '\0';
+        if(len == 0)    continue;   // Empty line
+        if(count >= (int)maxsettings) {
+            warnx("Too many settings in profile %s", filename);
+            fclose(file);
+            return -1;
+        }
+        if(strchr(text, '=')) {     // Field setting
+            if(resolveFieldSetting(text, &settings[count]) < 0) {
+                warnx("Invalid field setting in profile %s line %u", filename, linenum);
+                fclose(file);
+                return -1;
+            }
+            count++;
+            continue;
+        }
+        long reg, value, mask = 0xFFFF;
+        char extra;
+        int n = sscanf(text, "%li %li %li %c", &reg, &value, &mask, &extra);
+        if(n < 2 || n > 3 || reg < 0 || reg > CM6206_NUM_REGS-1 || value < 0 || value > 0xFFFF || mask < 0 || mask > 0xFFFF) {
+            warnx("Invalid setting in profile %s line %u", filename, linenum);
+            fclose(file);
+            return -1;
+        }
+        settings[count++] = (cm6206_setting){reg, mask, value};
+    }
+    fclose(file);
+    return count;
+}
+
+// Queue profile settings. Only registers which change value are written by commitWrites()
+// Returns 0 on success, -1 on error
+int applyProfile(cm6206_ctx *ctx, const cm6206_setting *settings, unsigned count) {
+    int res = cm6206_queue(ctx, settings, count);
+    return (res < 0) ? deviceError(ctx, res) : 0;
+}
+
+// Write all queued settings. Settings are merged per register, so a register is written at most
+// once and then verified with a single read. Returns number of registers written or -1 on error
+int commitWrites(cm6206_ctx *ctx) {
+    cm6206_commit_result result;
+    int written = cm6206_commit(ctx, &result);
+    const uint16_t *regs = cm6206_shadow(ctx, NULL);
+    for(int r=0; r<CM6206_NUM_REGS; r++) {
+        if(!(result.written & (1u << r)) || cfg.quiet)  continue;
+        if(result.prevValid & (1u << r)) {
+            printf("Writing to Register %u, Value 0x%04X (was 0x%04X)\n", r, result.values[r], result.prev[r]);
+        } else {
+            printf("Writing to Register %u, Value 0x%04X\n", r, result.values[r]);
+        }
+    }
+    if(written < 0)     return deviceError(ctx, written);
+    for(int r=0; r<CM6206_NUM_REGS; r++) {
+        if(result.mismatch & (1u << r)) { warnx("Register %u reads 0x%04X after writing 0x%04X", r, regs[r], result.values[r]); }
+    }
+    return written;
+}
+
+
+
+//////// GPIO output (--gpio)
+// Steps are separated by ';' or newlines. A step is "[@<ms>|+<ms>] <gpio>=<1|0|t|z> ..." where t toggles
+// and z switches the GPIO to input. '@' schedules the step at a time from the start, '+' at a time after
+// the previously scheduled step (without drift). Steps without time follow the previous step at once.
+
+// Parse GPIO step from tokens of text (modified in place). Returns 1 if a step was parsed, 0 if text is empty
+int parseGpioStep(char *text, cm6206_gpio_step *step, int64_t *schedUs) {
+    *step = (cm6206_gpio_step){.atUs = -1};
+    bool empty = true;
+    char *saveptr;
+    for(char *tok = strtok_r(text, " \t\r", &saveptr); tok; tok = strtok_r(NULL, " \t\r", &saveptr)) {
+        char *end;
+        if(tok[0] == '@' || tok[0] == '+') {
+            double ms = strtod(tok+1, &end);
+            if(end == tok+1 || *end || ms < 0 || ms > 1e9 || step->atUs >= 0 || !empty) {
+                warnx("Invalid GPIO step time \"%s\". Use '@<ms>' or '+<ms>' before the GPIOs", tok);
+                return -1;
             }
+            step->atUs = (int64_t)(ms*1000) + (tok[0] == '+' ? *schedUs : 0);
+            *schedUs = step->atUs;
+            continue;
+        }
+        unsigned long gpio = strtoul(tok, &end, 10);
+        if(end == tok || gpio < 1 || gpio > CM6206_NUM_GPIOS || end[0] != '=' || !end[1] || end[2]
+           || !strchr("10tz", end[1])) {
+            warnx("Invalid GPIO setting \"%s\". Use '<gpio 1-%d>=<1|0|t|z>'", tok, CM6206_NUM_GPIOS);
+            return -1;
+        }
+        uint16_t *masks[] = {&step->high, &step->low, &step->toggle, &step->release};
+        *masks[strchr("10tz", end[1]) - "10tz"] |= CM6206_GPIO(gpio);
+        empty = false;
+    }
+    if(empty && step->atUs >= 0) {
+        warnx("GPIO step at %.3f ms has no GPIOs", step->atUs/1e3);
+        return -1;
+    }
+    return !empty;
+}
+
+// Parse GPIO steps of text into steps (NULL = only check syntax). schedUs is the time of the last
+// scheduled step. Returns number of steps or -1 on error
+int parseGpioSteps(const char *text, cm6206_gpio_step *steps, unsigned maxsteps, int64_t *schedUs) {
+    char *copy = strdup(text);
+    if(!copy) { warnx("Out of memory"); return -1; }
+    int count = 0;
+    char *saveptr;
+    for(char *str = strtok_r(copy, ";\n", &saveptr); str && count >= 0; str = strtok_r(NULL, ";\n", &saveptr)) {
+        cm6206_gpio_step step;
+        int res = parseGpioStep(str, &step, schedUs);
+        if(res < 0) {
+            count = -1;
+        } else if(res && steps && (unsigned)count >= maxsteps) {
+            warnx("Too many GPIO steps (max %u)", maxsteps);
+            count = -1;
+        } else if(res) {
+            if(steps)   steps[count] = step;
+            count++;
+        }
+    }
+    free(copy);
+    return count;
+}
+
+// Drive GPIOs by steps of --gpio. Steps from stdin ("-") are applied as soon as a line is read
+// Returns 0 on success, -1 on error
+int runGpio(cm6206_ctx *ctx) {
+    static cm6206_gpio_step steps[MAX_GPIO_STEPS];
+    bool stream = strcmp(cfg.gpioSteps, "-") == 0;
+    int64_t schedUs = 0, startNs = 0;
+    cm6206_stats before, after;
+    cm6206_get_stats(ctx, &before);
+    char *line = NULL;
+    size_t size = 0;
+    unsigned total = 0;
+    int status = 0;
+    while(true) {
+        const char *text = cfg.gpioSteps;
+        if(stream && getline(&line, &size, stdin) < 0)  break;
+        if(stream)  text = line;
+        int count = parseGpioSteps(text, steps, MAX_GPIO_STEPS, &schedUs);
+        if(count < 0) { status = -1; break; }
+        int res = cm6206_gpio_run(ctx, steps, count, &startNs);
+        if(res < 0) { status = deviceError(ctx, res); break; }
+        total += res;
+        if(!stream || res < count)  break;  // Done or interrupted by signal
+    }
+    free(line);
+    cm6206_get_stats(ctx, &after);
+    if(!cfg.quiet && startNs) {
+        double ms = (monotonicNs() - startNs)/1e6;
+        unsigned long long writes = after.reportsWritten - before.reportsWritten;
+        printf("GPIO steps: %u, writes: %llu in %.1f ms", total, writes, ms);
+        if(writes && after.writeNs > before.writeNs) {
+            printf(" (%.0f us per write)", (after.writeNs - before.writeNs)/1e3/writes);
         }
+        printf("\n");
     }
+    return status;
+}
+
+
+/////// Printout of registers functions
+
+// Output buffer of printouts. Kept between printouts to avoid reallocation
+cm6206_buf printBuf = {0};
+
+// Rendering flags of configuration
+unsigned renderFlags(void) {
+    return (cfg.verbose ? CM6206_RENDER_VERBOSE : 0) | (cfg.quiet ? CM6206_RENDER_QUIET : 0);
+}
+
+// Write rendered printout with a single write
+void flushPrintout(void) {
+    fflush(stdout);     // Keep order with other output
+    if(cm6206_buf_write(&printBuf, STDOUT_FILENO) == CM6206_ERR_NOMEM) { warnx("Printout lost: out of memory"); }
+}
+
+// Print all registers of device context in selected output format
+void printRegisters(cm6206_ctx *ctx) {
+    int64_t start = monotonicNs();
+    unsigned valid;
+    const uint16_t *regs = cm6206_shadow(ctx, &valid);
+    cm6206_render_regs(&printBuf, regs, valid, cfg.output, renderFlags());
+    flushPrintout();
+    runStats.renderNs += monotonicNs() - start;
+}
+
+// Print changes of registers
+void printChanges(const uint16_t *prev, const uint16_t *cur) {
+    int64_t start = monotonicNs();
+    cm6206_render_changes(&printBuf, prev, cur, cfg.output, renderFlags());
+    flushPrintout();
+    runStats.renderNs += monotonicNs() - start;
 }
 
 
@@ -388,14 +872,50 @@ void printHelp(void) {
     printf("Usage: cm6206ctl  [-r <reg> [-m <mask>] [-w <value>]][other options]\n");
     printf("Generic Options:\n");
     printf("    -A            Printout content of all registers in decoded form\n");
+    printf("    -B <backend>  Transport backend: 'hidapi' (default), 'hidraw', 'libusb' or 'emu[:<parameters>]'\n");
+    printf("                  (emulated CM6206). Given several times, --bench compares the backends\n");
     printf("    -D            List all available devices\n");
-    printf("    -d <device>   Select device as returned by -D (e.g. '0001:0012:03')\n");
+    printf("    -d <device>   Select device as returned by -D (e.g. '0001:0012:03'), by USB port (e.g. '1-1.4') or serial\n");
+    printf("                  'all' or a comma separated list of devices/serials runs on devices in parallel\n");
+    printf("    -f <file>     Execute commands from file, one command per line ('-' = stdin, single device only)\n");
     printf("    -h            Print this help text\n");
+    printf("    -L            Listen for asynchronous input reports (e.g. buttons) and print them as events\n");
     printf("    -m <mask>     Binary mask for reading/writing only some bits (e.g. 0x8000) [default=0xFFFF]\n");
+    printf("    -p <file>     Apply profile. Only registers which change value are written\n");
     printf("    -q            Quiet. Only output necessary values\n");
     printf("    -r <reg>      Register to read or write\n");
+    printf("    -t <ms>       Deadline for each USB transfer and device open (0 = no deadline) [default=%d]\n", CM6206_DEFAULT_TIMEOUT_MS);
+    printf("    -S <socket>   Send command to daemon listening on socket instead of opening device\n");
     printf("    -v            Verbose printout\n");
     printf("    -w <value>    Write value to selected register\n");
+    printf("    -W <ms>       Watch registers. Poll every <ms> and print fields which changed\n");
+    printf("    --cache <ms>  Answer read-only commands from shadow cache if younger than <ms>\n");
+    printf("    --cache-dir <dir>  Directory of shadow cache [default=%s]\n", DEFAULT_CACHE_DIR);
+    printf("    --set <field>=<value>  Set register field by name to label or number (as printed by -A -v)\n");
+    printf("    --gpio <steps> Drive GPIO1-12 without read back. Steps are separated by ';': '[@<ms>|+<ms>] <gpio>=<1|0|t|z> ...'\n");
+    printf("                  (t = toggle, z = input). '@' times a step from the start, '+' after the previous one.\n");
+    printf("                  '-' streams steps from stdin\n");
+    printf("    --json        Output registers and decoded fields as JSON (one object per line)\n");
+    printf("    --binary      Output registers as fixed layout binary records (raw values and timestamp)\n");
+    printf("    --bench <n>   Measure latency of register reads/writes over <n> iterations (with -r: register)\n");
+    printf("    --stress <s>  Verified writes (write and read back) of register (-r) for <s> seconds. With -w the\n");
+    printf("                  register alternates with the value of -w (bits of -m). Reports rate, errors and drift\n");
+    printf("    --rate <n>    Target rate of --stress in writes per second (0 = unlimited) [default=0]\n");
+    printf("    --concurrency <n>  Number of --stress workers, each with its own device context [default=1]\n");
+    printf("    --stats       Print transfer counters and time per phase on exit (to stderr, with --json as JSON)\n");
+    printf("    --trace       Print trace of the last %d USB transfers on error and on SIGUSR1 (-W, -L, --daemon)\n", CM6206_TRACE_SIZE);
+    printf("    --dump-trace  Print trace of the last USB transfers (e.g. of a daemon with -S)\n");
+    printf("    --pipeline    Queue register read requests before collecting responses (falls back to lockstep)\n");
+    printf("    --retries <n> Number of retries of a register read without response [default=%d]\n", CM6206_DEFAULT_RETRIES);
+    printf("    --daemon      Keep device open and serve commands on socket (-S) [default=%s]\n", DEFAULT_SOCKET_PATH);
+    printf("                  With -W registers are re-read every <ms> between requests\n");
+    printf("    --shm <name>  Publish registers in shared memory (e.g. '/cm6206ctl') with -W or --daemon.\n");
+    printf("                  Otherwise answer read-only commands from it\n");
+    printf("    --follow <ms> Follow the ALSA playback stream of the card: set SPDIF Out sample rate, Non-audio and\n");
+    printf("                  DMA Master when the stream changes (checked every <ms> and when a PCM device is opened)\n");
+    printf("    --card <card> ALSA card number or directory (e.g. '/proc/asound/card1') of --follow [default=card of device]\n");
+    printf("    --metrics <[addr:]port>  Serve registers, fields and transfer statistics on http://<addr>:<port>/metrics\n");
+    printf("                  for Prometheus. Registers are re-read every <ms> with -W, else at most once a second\n");
     printf("Shortcut Options:\n");
     printf("    +DMASPDIF     Set DMA master to SPDIF               (equivalent to '-r 0 -m 0x8000 -w 0x8000')\n");
     printf("    -DMASPDIF     Set DMA master to DAC (*)             (equivalent to '-r 0 -m 0x8000 -w 0x0000')\n");
@@ -404,51 +924,173 @@ void printHelp(void) {
     printf("    +MIXFRONT     Mix LineIn/Mic to Front channels only (equivalent to '-r 3 -m 0x0200 -w 0x0200')\n");
     printf("    -MIXFRONT     Mix LineIn/Mic to all 8 Channels (*)  (equivalent to '-r 3 -m 0x0200 -w 0x0000')\n");
     printf("    +INIT         Initialize all registers to sane default values (same as Linux driver)\n");
+    printf("                  (built-in profile, only registers which differ are written)\n");
     printf(" (*) = Default\n");
+    printf("Exit status: 0 = success, 1 = failure, %d = device did not respond within deadline\n", EXIT_TIMEOUT);
     printf("\n");
     printf("Examples:\n");
     printf(" cm6206ctl -A -v                    # Printout content of all registers in verbose form\n");
     printf(" cm6206ctl -r 0                     # Read content of register 0\n");
     printf(" cm6206ctl -r 2 -m 0x6000 -q        # Read and only output value of mask bits (example is 'Headphone source')\n");
     printf(" cm6206ctl -r 0 -w 0 0x8000 -m 0x8000    # Write 1 to bit 15 in register 0\n");
+    printf(" cm6206ctl --set \"Mute Center=Yes\" --set \"Headphone Source channels=Front\"\n");
+    printf(" cm6206ctl -p spdif.prof            # Apply profile 'spdif.prof'\n");
+    printf(" cm6206ctl -f setup.txt -q          # Execute all commands in 'setup.txt' with one device open\n");
+    printf(" cm6206ctl --gpio '1=1; +100 1=0'   # Pulse GPIO1 high for 100 ms\n");
+    printf(" cm6206ctl -W 100                   # Print every change of register fields (polled every 100 ms)\n");
+    printf(" cm6206ctl --follow 50              # Switch SPDIF Out sample rate with the playback stream\n");
+    printf(" cm6206ctl --daemon -S /tmp/cm.sock # Run daemon. Then use e.g. 'cm6206ctl -S /tmp/cm.sock -r 0'\n");
     printf("\n");
     printf("Supported devices: (USB)\n");
-    printf(" ID %04x:%04x  C-Media CM6206 or CM6206_LX\n", USB_VENDOR_ID, USB_PRODUCT_ID);
+    printf(" ID %04x:%04x  C-Media CM6206 or CM6206_LX\n", CM6206_VENDOR_ID, CM6206_PRODUCT_ID);
 }
 
 
-void parseArgumentsToConfig(int argc, char* argv[]) {
+// Report error in arguments and return from parser
+#define ARG_ERROR(...)  do { warnx(__VA_ARGS__); return -1; } while(0)
+
+// Parse arguments into global configuration. Returns 0 on success, -1 on error
+int parseArgumentsToConfig(int argc, char* argv[]) {
     long lval;      // scratchpad
     int argn = 1;   // argument counter
     while(argn < argc) {
         if(strcmp(argv[argn], "-A")==0) {
             cfg.cmdPrintAll = true;
+        } else if(cfg.inScript && (strcmp(argv[argn], "-D")==0 || strcmp(argv[argn], "-d")==0 || strcmp(argv[argn], "-B")==0
+                                   || strcmp(argv[argn], "-f")==0 || strcmp(argv[argn], "-h")==0
+                                   || strcmp(argv[argn], "-S")==0 || strcmp(argv[argn], "--daemon")==0
+                                   || strcmp(argv[argn], "-W")==0 || strcmp(argv[argn], "-L")==0
+                                   || strcmp(argv[argn], "--bench")==0 || strcmp(argv[argn], "--stats")==0
+                                   || strcmp(argv[argn], "--stress")==0 || strcmp(argv[argn], "--rate")==0
+                                   || strcmp(argv[argn], "--concurrency")==0 || strcmp(argv[argn], "--shm")==0
+                                   || strcmp(argv[argn], "--metrics")==0 || strcmp(argv[argn], "--trace")==0
+                                   || strcmp(argv[argn], "--follow")==0 || strcmp(argv[argn], "--card")==0)) {
+            ARG_ERROR("Argument \"%s\" not allowed in script or daemon request", argv[argn]);
         } else if(strcmp(argv[argn], "-D")==0) {
             printAvailableUSBDevices(); exit(0);
+        } else if(strcmp(argv[argn], "-B")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-B too few arguments"); }
+            cfg.backend = argv[++argn];
+            if(cfg.numBackends < MAX_BENCH_BACKENDS)    cfg.backends[cfg.numBackends++] = cfg.backend;
         } else if(strcmp(argv[argn], "-d")==0) {
-            if(argc-argn-1 < 1) { err(EXIT_FAILURE, "-d too few arguments"); }
+            if(argc-argn-1 < 1) { ARG_ERROR("-d too few arguments"); }
             cfg.devicePath = argv[++argn];
+        } else if(strcmp(argv[argn], "-f")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-f too few arguments"); }
+            cfg.scriptFile = argv[++argn];
+        } else if(strcmp(argv[argn], "-S")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-S too few arguments"); }
+            cfg.socketPath = argv[++argn];
+        } else if(strcmp(argv[argn], "-L")==0) {
+            cfg.listen = true;
+        } else if(strcmp(argv[argn], "-W")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-W too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<1 || lval>3600000) { ARG_ERROR("-W value out of range [1;3600000]"); }
+            cfg.watchMs = lval;
+        } else if(strcmp(argv[argn], "--follow")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--follow too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<1 || lval>60000) { ARG_ERROR("--follow value out of range [1;60000]"); }
+            cfg.followMs = lval;
+        } else if(strcmp(argv[argn], "--card")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--card too few arguments"); }
+            cfg.alsaCard = argv[++argn];
+        } else if(strcmp(argv[argn], "--daemon")==0) {
+            cfg.daemon = true;
+        } else if(strcmp(argv[argn], "--shm")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--shm too few arguments"); }
+            cfg.shmName = argv[++argn];
+        } else if(strcmp(argv[argn], "--metrics")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--metrics too few arguments"); }
+            cfg.metricsAddr = argv[++argn];
         } else if(strcmp(argv[argn], "-h")==0) {
             printHelp(); exit(0);
         } else if(strcmp(argv[argn], "-m")==0) {
-            if(argc-argn-1 < 1) { err(EXIT_FAILURE, "-m too few arguments"); }
+            if(argc-argn-1 < 1) { ARG_ERROR("-m too few arguments"); }
             lval = strtol(argv[++argn], NULL, 0);
-            if(lval<0 || lval>0xFFFF) { err(EXIT_FAILURE, "-m value out of range [0;0xFFFF]"); }
+            if(lval<0 || lval>0xFFFF) { ARG_ERROR("-m value out of range [0;0xFFFF]"); }
             cfg.mask = lval;
+        } else if(strcmp(argv[argn], "-p")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-p too few arguments"); }
+            cfg.profileFile = argv[++argn];
         } else if(strcmp(argv[argn], "-q")==0) {
             cfg.quiet = true;
         } else if(strcmp(argv[argn], "-r")==0) {
-            if(argc-argn-1 < 1) { err(1, "-r too few arguments"); }
+            if(argc-argn-1 < 1) { ARG_ERROR("-r too few arguments"); }
             lval = strtol(argv[++argn], NULL, 0);
-            if(lval<0 || lval>NUM_REGS-1) { err(EXIT_FAILURE, "-r value out of range [0;%u]", NUM_REGS-1); }
+            if(lval<0 || lval>CM6206_NUM_REGS-1) { ARG_ERROR("-r value out of range [0;%u]", CM6206_NUM_REGS-1); }
             cfg.reg = lval;
             cfg.cmdRead = true;
+        } else if(strcmp(argv[argn], "-t")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("-t too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<0 || lval>60000) { ARG_ERROR("-t value out of range [0;60000]"); }
+            cfg.timeoutMs = lval;
+        } else if(strcmp(argv[argn], "--cache")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--cache too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<0 || lval>86400000) { ARG_ERROR("--cache value out of range [0;86400000]"); }
+            cfg.cacheMaxAgeMs = lval;
+        } else if(strcmp(argv[argn], "--cache-dir")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--cache-dir too few arguments"); }
+            cfg.cacheDir = argv[++argn];
+        } else if(strcmp(argv[argn], "--set")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--set too few arguments"); }
+            if(cfg.numFieldSettings >= MAX_FIELD_SETTINGS) { ARG_ERROR("--set too many fields"); }
+            if(resolveFieldSetting(argv[++argn], &cfg.fieldSettings[cfg.numFieldSettings]) < 0)   return -1;
+            cfg.numFieldSettings++;
+        } else if(strcmp(argv[argn], "--json")==0) {
+            cfg.output = CM6206_FORMAT_JSON;
+            cfg.quiet = true;   // No informational text in between
+        } else if(strcmp(argv[argn], "--binary")==0) {
+            cfg.output = CM6206_FORMAT_BINARY;
+            cfg.quiet = true;
+        } else if(strcmp(argv[argn], "--gpio")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--gpio too few arguments"); }
+            cfg.gpioSteps = argv[++argn];
+            int64_t schedUs = 0;
+            if(strcmp(cfg.gpioSteps, "-") == 0 && cfg.inScript) { ARG_ERROR("--gpio - not allowed in script or daemon request"); }
+            if(strcmp(cfg.gpioSteps, "-") != 0 && parseGpioSteps(cfg.gpioSteps, NULL, 0, &schedUs) < 0)   return -1;
+        } else if(strcmp(argv[argn], "--bench")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--bench too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<1 || lval>1000000) { ARG_ERROR("--bench value out of range [1;1000000]"); }
+            cfg.benchIterations = lval;
+        } else if(strcmp(argv[argn], "--stress")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--stress too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<1 || lval>604800) { ARG_ERROR("--stress value out of range [1;604800]"); }
+            cfg.stressSeconds = lval;
+        } else if(strcmp(argv[argn], "--rate")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--rate too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<0 || lval>1000000) { ARG_ERROR("--rate value out of range [0;1000000]"); }
+            cfg.stressRate = lval;
+        } else if(strcmp(argv[argn], "--concurrency")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--concurrency too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<1 || lval>MAX_STRESS_WORKERS) { ARG_ERROR("--concurrency value out of range [1;%d]", MAX_STRESS_WORKERS); }
+            cfg.stressWorkers = lval;
+        } else if(strcmp(argv[argn], "--stats")==0) {
+            cfg.stats = true;
+        } else if(strcmp(argv[argn], "--trace")==0) {
+            cfg.trace = true;
+        } else if(strcmp(argv[argn], "--dump-trace")==0) {
+            cfg.cmdDumpTrace = true;
+        } else if(strcmp(argv[argn], "--pipeline")==0) {
+            cfg.pipeline = true;
+        } else if(strcmp(argv[argn], "--retries")==0) {
+            if(argc-argn-1 < 1) { ARG_ERROR("--retries too few arguments"); }
+            lval = strtol(argv[++argn], NULL, 0);
+            if(lval<0 || lval>100) { ARG_ERROR("--retries value out of range [0;100]"); }
+            cfg.retries = lval;
         } else if(strcmp(argv[argn], "-v")==0) {
             cfg.verbose = true;
         } else if(strcmp(argv[argn], "-w")==0) {
-            if(argc-argn-1 < 1) { err(1, "-w too few arguments"); }
+            if(argc-argn-1 < 1) { ARG_ERROR("-w too few arguments"); }
             lval = strtol(argv[++argn], NULL, 0);
-            if(lval<0 || lval>0xFFFF) { err(EXIT_FAILURE, "-w value out of range [0;0xFFFF]"); }
+            if(lval<0 || lval>0xFFFF) { ARG_ERROR("-w value out of range [0;0xFFFF]"); }
             cfg.writeVal = lval;
             cfg.cmdWrite = true;
         } else if(strcmp(argv[argn], "+DMASPDIF")==0) {
@@ -472,60 +1114,1631 @@ void parseArgumentsToConfig(int argc, char* argv[]) {
         } else if(strcmp(argv[argn], "+INIT")==0) {
             cfg.cmdInit = true;
         } else {
-            err(EXIT_FAILURE, "Unknown argument \"%s\". Use -h for help", argv[argn]);
+            ARG_ERROR("Unknown argument \"%s\". Use -h for help", argv[argn]);
         }
         argn++;
     }
+    return 0;
 }
 
 
-int main(int argc, char* argv[]) {
-    hid_device *hid_dev;                // USB device handle
+// Queue writes of the commands in the configuration. Returns 0 on success, -1 on error
+int queueCommands(cm6206_ctx *ctx) {
+    if(cfg.cmdInit) {
+        if(!cfg.quiet) { printf("Initializing registers...\n"); }
+        if(applyProfile(ctx, cm6206_profile_init, cm6206_profile_init_count) < 0)  return -1;
+    }
 
-    parseArgumentsToConfig(argc, argv);
+    if(cfg.profileFile) {
+        cm6206_setting settings[MAX_PROFILE_SETTINGS];
+        int count = loadProfile(cfg.profileFile, settings, MAX_PROFILE_SETTINGS);
+        if(count < 0)   return -1;
+        if(!cfg.quiet) { printf("Applying profile %s...\n", cfg.profileFile); }
+        if(applyProfile(ctx, settings, count) < 0)  return -1;
+    }
 
-    if(cfg.devicePath) {    // Open by path or ID
-        hid_dev = hid_open_path(cfg.devicePath);
-    } else {
-        hid_dev = hid_open(USB_VENDOR_ID, USB_PRODUCT_ID, NULL);
+    if(cfg.numFieldSettings) {
+        if(applyProfile(ctx, cfg.fieldSettings, cfg.numFieldSettings) < 0)     return -1;
     }
-    if(!hid_dev) {
-        err(EXIT_FAILURE, "Could not open USB device %s (hid_open: %ls)",
-            cfg.devicePath, hid_error(hid_dev));
+
+    if(cfg.cmdWrite) {
+        int res = cm6206_queue_write(ctx, cfg.reg, cfg.mask, cfg.writeVal);  // Read-modify-write if mask is partial
+        if (res < 0)
+            return deviceError(ctx, res);
     }
+    return 0;
+}
 
-    if(!cfg.quiet) { printUSBDeviceInfo(hid_dev); }
+// Output registers selected in the configuration. Returns 0 on success, -1 on error
+int printCommands(cm6206_ctx *ctx) {
+    if(cfg.cmdRead) {
+        uint16_t value;
+        int res = cm6206_get(ctx, cfg.reg, &value);
+        if(res < 0)     return deviceError(ctx, res);
+        if(!cfg.quiet) { printf("Reading from Register %u, Value 0x%04X, Mask 0x%04X\n", cfg.reg, value, cfg.mask); }
+        if(cfg.output == CM6206_FORMAT_JSON) {
+            printf("{\"register\":%u,\"raw\":%u,\"mask\":%u,\"value\":%u}\n",
+                cfg.reg, value, cfg.mask, (value & cfg.mask));
+        } else if(cfg.output == CM6206_FORMAT_BINARY && !cfg.cmdPrintAll) {
+            printRegisters(ctx);
+        } else if(cfg.output == CM6206_FORMAT_TEXT) {
+            printf("%u\n", (value & cfg.mask));
+        }
+    }
 
-    // Start by reading all registers
-    readAllRegisters(hid_dev);
+    if(cfg.cmdPrintAll) {
+        if(syncRegisters(ctx, CM6206_ALL_REGS) < 0)     return -1;
+        printRegisters(ctx);
+    }
 
-    if(cfg.cmdInit) {
-        if(!cfg.quiet) { printf("Initializing registers...\n"); }
-        for(int n=0; n<NUM_REGS; n++) {
-            if (cm6206_write(hid_dev, n, REG_INIT[n]) < 0)
-                err(EXIT_FAILURE, "write: %ls, reg: %d", hid_error(hid_dev), n);
+    if(cfg.cmdDumpTrace) {
+        dumpTrace(ctx, STDOUT_FILENO);
+    }
+    return 0;
+}
+
+// Execute the commands currently selected in the configuration. Returns 0 on success, -1 on error
+// Registers are only transferred when needed: Writes (-p, --set, -w) are queued and merged per
+// register, then committed before any read and at the end. Each touched register is written once
+// and read back once. Within a batch script the writes of several lines are merged.
+int executeCommands(cm6206_ctx *ctx) {
+    cm6206_set_timeout(ctx, cfg.timeoutMs, cfg.retries);
+    cm6206_set_pipeline(ctx, cfg.pipeline);
+
+    int res = queueCommands(ctx);
+    if(res == 0 && (cfg.cmdRead || cfg.cmdPrintAll || cfg.gpioSteps || !batchWrites))   res = commitWrites(ctx);
+    if(res < 0) {
+        cm6206_discard(ctx);
+        return -1;
+    }
+    if(cfg.gpioSteps && runGpio(ctx) < 0)   return -1;
+    return printCommands(ctx);
+}
+
+
+// Split line into arguments. Arguments are separated by whitespace and may be "quoted".
+// Line is modified in place. Returns number of arguments or -1 on error
+int splitScriptLine(char *line, char *argv[], int maxargs) {
+    int argc = 0;
+    char *p = line;
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')  p++;
+        if(*p == '\0' || *p == '#')   break;  // End of line or comment
+        if(argc >= maxargs) {
+            warnx("Too many arguments in line");
+            return -1;
+        }
+        if(*p == '"') {     // Quoted argument
+            argv[argc++] = ++p;
+            while(*p && *p != '"')  p++;
+        } else {
+            argv[argc++] = p;
+            while(*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')  p++;
         }
-        readAllRegisters(hid_dev);
+        if(*p)  *p++ = '\0';
     }
+    return argc;
+}
 
-    if(cfg.cmdWrite) {
-        uint16_t newvalue = (regbuf[cfg.reg] & ~cfg.mask) | (cfg.writeVal & cfg.mask);
-        if(!cfg.quiet) { printf("Writing to Register %u, Value 0x%04X, Mask 0x%04X\n", cfg.reg, cfg.writeVal, cfg.mask); }
-        if (cm6206_write(hid_dev, cfg.reg, newvalue) < 0)
-            err(EXIT_FAILURE, "write: %ls, reg: %d", hid_error(hid_dev), cfg.reg);
-        readAllRegisters(hid_dev);  // Refresh
+// Parse command line of a script or daemon request into configuration on top of base configuration
+// Returns number of arguments (0 = empty line) or -1 on error
+int parseCommandLine(char *line, const struct Config *basecfg) {
+    char *argv[MAX_SCRIPT_ARGS+1] = {"cm6206ctl"};
+    int argc = splitScriptLine(line, argv+1, MAX_SCRIPT_ARGS);
+    if(argc <= 0)   return argc;
+    cfg = *basecfg;
+    cfg.cmdPrintAll = cfg.cmdRead = cfg.cmdWrite = cfg.cmdInit = cfg.cmdDumpTrace = false;
+    cfg.profileFile = cfg.gpioSteps = NULL;
+    cfg.numFieldSettings = 0;
+    cfg.mask = 0xFFFF;
+    cfg.inScript = true;
+    if(parseArgumentsToConfig(argc+1, argv) < 0)    return -1;
+    return argc;
+}
+
+// Execute all commands in script file against the open device
+void executeScript(cm6206_ctx *ctx, const char *filename) {
+    FILE *file = (strcmp(filename, "-")==0) ? stdin : fopen(filename, "r");
+    if(!file) { err(EXIT_FAILURE, "Could not open script file %s", filename); }
+
+    char line[1024];
+    unsigned linenum = 0;
+    const struct Config basecfg = cfg;  // Global options from command line
+    batchWrites = true;
+    while(fgets(line, sizeof(line), file)) {
+        linenum++;
+        int argc = parseCommandLine(line, &basecfg);
+        if(argc == 0)   continue;   // Empty line
+        if(argc < 0 || executeCommands(ctx) < 0) {
+            warnx("Script %s failed in line %u", filename, linenum);
+            exit(ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE);
+        }
     }
+    if(ferror(file)) { err(EXIT_FAILURE, "Could not read script file %s", filename); }
+    if(file != stdin)   fclose(file);
+    cfg = basecfg;
+    batchWrites = false;
+    if(commitWrites(ctx) < 0) {
+        warnx("Script %s failed at end of file", filename);
+        exit(ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE);
+    }
+}
 
-    if(cfg.cmdRead) {
-        if(!cfg.quiet) { printf("Reading from Register %u, Value 0x%04X, Mask 0x%04X\n", cfg.reg, regbuf[cfg.reg], cfg.mask); }
-        printf("%u\n", (regbuf[cfg.reg] & cfg.mask));
+
+//////// Device hotplug
+// Resident modes track kernel uevents, so that a replugged device is re-opened and set up again
+// as soon as it appears. No udev daemon is needed.
+
+int hotplugFd = -1;             // Netlink socket for kernel uevents (-1 = hotplug is not tracked)
+
+enum HotplugEvent { HOTPLUG_NONE, HOTPLUG_REMOVED, HOTPLUG_ADDED };
+
+// Open selected device (devid) in new context. Returns 0 or error code
+int openDevice(cm6206_ctx **ctx) {
+    int64_t start = monotonicNs();
+    watchdog(cfg.timeoutMs);
+    int res = cm6206_open_backend(cfg.backend, devidValid ? devid.path : cfg.devicePath, ctx);
+    watchdog(0);
+    runStats.openNs += monotonicNs() - start;
+    if(res < 0)     return res;
+    statsDevice = *ctx;
+    cm6206_set_io_guard(*ctx, watchdogGuard, NULL);
+    cm6206_set_write_hook(*ctx, cacheInvalidate, NULL);
+    cacheInvalidated = false;
+    return 0;
+}
+
+// Report failure to open selected device and exit
+void openError(int res) {
+    const char *path = devidValid ? devid.path : cfg.devicePath;
+    if(res == CM6206_ERR_OPEN) { err(EXIT_FAILURE, "Could not open USB device %s (%s)", path, cm6206_strerror(res)); }
+    errx(EXIT_FAILURE, "Could not open USB device %s (%s)", path, cm6206_strerror(res));
+}
+
+// Start tracking of hotplug events. Tracking is optional
+void hotplugOpen(void) {
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};    // Kernel uevents
+    hotplugFd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(hotplugFd >= 0 && bind(hotplugFd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(hotplugFd);
+        hotplugFd = -1;
     }
+    if(hotplugFd < 0 && cfg.verbose) { warn("Hotplug events not available"); }
+}
 
-    if(cfg.cmdPrintAll) {
-        print_cm6202_regs();
+// Read pending uevents. Returns last event concerning the selected device
+enum HotplugEvent hotplugRead(void) {
+    enum HotplugEvent event = HOTPLUG_NONE;
+    char buf[4096];
+    ssize_t len;
+    while((len = recv(hotplugFd, buf, sizeof(buf)-1, MSG_DONTWAIT)) > 0) {
+        buf[len] = '\0';
+        const char *action = "", *devpath = "", *devtype = "", *product = "";
+        for(char *p = buf; p < buf+len; p += strlen(p)+1) {     // "<action>@<devpath>" and "KEY=value" strings
+            if(strncmp(p, "ACTION=", 7) == 0)       action = p+7;
+            else if(strncmp(p, "DEVPATH=", 8) == 0) devpath = p+8;
+            else if(strncmp(p, "DEVTYPE=", 8) == 0) devtype = p+8;
+            else if(strncmp(p, "PRODUCT=", 8) == 0) product = p+8;
+        }
+        unsigned vid, pid;
+        if(strcmp(devtype, "usb_device") != 0 || sscanf(product, "%x/%x", &vid, &pid) != 2
+           || vid != CM6206_VENDOR_ID || pid != CM6206_PRODUCT_ID)   continue;
+        const char *topology = strrchr(devpath, '/') ? strrchr(devpath, '/')+1 : devpath;
+        struct DeviceId id;
+        if(strcmp(action, "remove") == 0 && devidValid && strcmp(topology, devid.topology) == 0) {
+            event = HOTPLUG_REMOVED;
+        } else if(strcmp(action, "add") == 0 && readDeviceId(topology, &id) == 0 && deviceMatches(cfg.devicePath, &id)) {
+            event = HOTPLUG_ADDED;
+        }
     }
+    return event;
+}
 
-    hid_close(hid_dev);
-    hid_exit();
+// Wait up to timeout (-1 = forever) for hotplug event of selected device. Interrupted by signals
+enum HotplugEvent hotplugWait(int timeoutMs) {
+    struct pollfd pfd = {.fd = hotplugFd, .events = POLLIN};
+    if(poll(&pfd, hotplugFd >= 0 ? 1 : 0, timeoutMs) <= 0)  return HOTPLUG_NONE;
+    return hotplugRead();
+}
+
+// Re-open selected device after it was plugged in and apply the settings of the command line again
+// Returns 0 on success, -1 on error
+int reconnectDevice(cm6206_ctx **ctx) {
+    closeDevice(*ctx);
+    *ctx = NULL;
+    selectDevice();
+    int res = -1;
+    for(int attempt=0; attempt<REOPEN_ATTEMPTS && res < 0 && !stopRequested; attempt++) {
+        if(attempt) {   // Device is still being set up by the kernel
+            struct timespec ts = {0, REOPEN_DELAY_MS*1000000};
+            nanosleep(&ts, NULL);
+        }
+        res = openDevice(ctx);
+    }
+    if(res < 0) {
+        warnx("Could not re-open USB device %s (%s)", devid.path, cm6206_strerror(res));
+        return -1;
+    }
+    if(!cfg.quiet) { printf("Device reconnected: %s\n", devid.path); }
+    struct Config savedcfg = cfg;
+    cfg.cmdRead = cfg.cmdPrintAll = false;  // Only settings
+    cfg.gpioSteps = NULL;                   // GPIO sequences are not replayed
+    res = executeCommands(*ctx);
+    cfg = savedcfg;
+    fflush(stdout);
+    return res;
+}
+
+// Handle hotplug event of selected device
+void handleHotplug(cm6206_ctx **ctx, enum HotplugEvent event) {
+    if(event == HOTPLUG_REMOVED && *ctx) {
+        if(!cfg.quiet) { printf("Device removed: %s\n", devid.path); fflush(stdout); }
+        closeDevice(*ctx);
+        *ctx = NULL;
+    } else if(event == HOTPLUG_ADDED) {
+        reconnectDevice(ctx);
+    }
+    if(event != HOTPLUG_NONE)   shmPublish(*ctx);
+}
+
+// Device failed in resident mode. Device is closed until it is plugged in again
+// Returns -1 if hotplug is not tracked (device is lost)
+int deviceLost(cm6206_ctx **ctx) {
+    if(hotplugFd < 0)   return -1;
+    handleHotplug(ctx, HOTPLUG_REMOVED);
     return 0;
 }
+
+
+//////// Resident modes
+
+void stopSignalHandler(int signum) {
+    (void)signum;
+    stopRequested = 1;
+}
+
+// Terminate resident modes cleanly on SIGINT/SIGTERM. Blocking calls are interrupted (no SA_RESTART)
+void installStopHandler(void) {
+    struct sigaction sa = {.sa_handler = stopSignalHandler};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Tuple for list of value/label pairs. Last tuple in list must have value -1 and a default label
+typedef struct { int val; const char *label; } ValLabel;
+
+// Button bits of asynchronous input reports (as in the C-Media CM108/CM119 family)
+static const ValLabel EVENT_BUTTONS[] = {
+    {0x01, "Volume Up"},
+    {0x02, "Volume Down"},
+    {0x04, "Playback Mute"},
+    {0x08, "Record Mute"},
+    {-1, ""}
+};
+
+// Print asynchronous input report as event
+void printEvent(void *user, const uint8_t *report, int len) {
+    (void)user;
+    printf("Event: ");
+    for(int n=0; n<len; n++)    printf("%02X ", report[n]);
+    if(!(report[0] & 0x0F)) {
+        printf("(released)");
+    }
+    for(int n=0; EVENT_BUTTONS[n].val >= 0; n++) {
+        if(report[0] & EVENT_BUTTONS[n].val)    printf("[%s] ", EVENT_BUTTONS[n].label);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Wait for asynchronous input reports until timeout (-1 = forever). Returns 0 or error code
+int waitForEvents(cm6206_ctx *ctx, int timeoutMs) {
+    uint8_t buf[8];
+    int64_t deadline = monotonicMs() + timeoutMs;
+    while(!stopRequested) {
+        int remaining = (timeoutMs < 0) ? 1000 : (int)(deadline - monotonicMs());  // Check for stop each second
+        if(timeoutMs >= 0 && remaining <= 0)    break;
+        int res = cm6206_read_report(ctx, buf, sizeof(buf), remaining);
+        if(res < 0) {
+            if(stopRequested)   break;  // Interrupted
+            warnx("%s", cm6206_error(ctx));
+            return res;
+        }
+        if(res > 0)     printEvent(NULL, buf, res);
+    }
+    return 0;
+}
+
+// Poll registers every cfg.watchMs and print the fields which changed
+// With cfg.listen asynchronous input reports are printed as events while waiting
+// A replugged device is re-opened and the commands of the command line are applied again
+int runWatch(cm6206_ctx **ctx) {
+    uint16_t prev[CM6206_NUM_REGS];
+    bool havePrev = false;
+    installStopHandler();
+    int64_t next = monotonicMs();
+    while(!stopRequested) {
+        checkTraceRequest(*ctx);
+        if(!*ctx) {     // Wait for device to be plugged in again
+            handleHotplug(ctx, hotplugWait(1000));
+            next = monotonicMs();
+            continue;
+        }
+        if(cfg.listen) { cm6206_set_async_handler(*ctx, printEvent, NULL); }
+        if(cfg.watchMs) {
+            cm6206_invalidate(*ctx, CM6206_ALL_REGS);
+            if(syncRegisters(*ctx, CM6206_ALL_REGS) < 0) {
+                if(deviceLost(ctx) < 0)     return -1;
+                continue;
+            }
+            const uint16_t *regs = cm6206_shadow(*ctx, NULL);
+            if(cfg.cacheMaxAgeMs) { cacheStoreContext(*ctx); }
+            shmPublish(*ctx);
+            if(havePrev && memcmp(prev, regs, sizeof(prev)) != 0) {
+                printChanges(prev, regs);
+            }
+            memcpy(prev, regs, sizeof(prev));
+            havePrev = true;
+            fflush(stdout);
+            next += cfg.watchMs;
+        }
+        int64_t delay = cfg.watchMs ? next - monotonicMs() : 1000;  // Only listening: Check for stop each second
+        if(delay <= 0) {
+            next = monotonicMs();   // Overrun. Do not try to catch up
+        } else if(cfg.listen) {
+            if(waitForEvents(*ctx, delay) < 0 && deviceLost(ctx) < 0)   return -1;
+            handleHotplug(ctx, hotplugWait(0));
+        } else {
+            handleHotplug(ctx, hotplugWait(delay));
+        }
+    }
+    return 0;
+}
+
+
+//////// ALSA follow mode (--follow)
+// The playback stream of the ALSA card of the device is followed from the hw_params files in procfs.
+// A change of rate or format is applied to REG0 with a single write of the changed register. Opening of
+// a PCM device node is seen with inotify, after which the state is checked quickly until the stream is set up.
+
+// State of ALSA playback stream
+struct AlsaStream {
+    bool    running;        // A playback substream has hw_params (is open and set up)
+    unsigned    rate;
+    unsigned    channels;
+    char    format[32];
+};
+
+// Find procfs directory of ALSA card of selected device (or --card). Returns 0 on success, -1 if none
+int alsaCardDir(char *buf, size_t size) {
+    if(cfg.alsaCard) {
+        if(strchr(cfg.alsaCard, '/'))   snprintf(buf, size, "%s", cfg.alsaCard);
+        else                            snprintf(buf, size, "%s/card%s", ALSA_PROC_DIR, cfg.alsaCard);
+        return 0;
+    }
+    if(!devidValid)     return -1;
+    char devdir[256];   // Sound card is a child of an audio interface "<topology>:1.<n>"
+    snprintf(devdir, sizeof(devdir), "%s/%s", SYSFS_USB_DEVICES, devid.topology);
+    DIR *dir = opendir(devdir);
+    if(!dir)    return -1;
+    int card = -1;
+    struct dirent *de;
+    while(card < 0 && (de = readdir(dir))) {
+        if(strncmp(de->d_name, devid.topology, strlen(devid.topology)) != 0 || de->d_name[strlen(devid.topology)] != ':')
+            continue;
+        char sounddir[800];
+        snprintf(sounddir, sizeof(sounddir), "%s/%s/sound", devdir, de->d_name);
+        DIR *sdir = opendir(sounddir);
+        if(!sdir)   continue;
+        struct dirent *sde;
+        while(card < 0 && (sde = readdir(sdir))) {
+            if(sscanf(sde->d_name, "card%d", &card) != 1)   card = -1;
+        }
+        closedir(sdir);
+    }
+    closedir(dir);
+    if(card < 0)    return -1;
+    snprintf(buf, size, "%s/card%d", ALSA_PROC_DIR, card);
+    return 0;
+}
+
+// Read hw_params of substream. Returns 0 if the substream is set up
+int readAlsaHwParams(const char *filename, struct AlsaStream *stream) {
+    FILE *file = fopen(filename, "r");
+    if(!file)   return -1;
+    char line[128];
+    struct AlsaStream st = {.running = true};
+    while(fgets(line, sizeof(line), file)) {
+        if(strncmp(line, "closed", 6) == 0) { st.running = false; break; }
+        if(sscanf(line, "format: %31s", st.format) == 1)    continue;
+        if(sscanf(line, "rate: %u", &st.rate) == 1)         continue;
+        sscanf(line, "channels: %u", &st.channels);
+    }
+    fclose(file);
+    if(!st.running || !st.rate)     return -1;
+    *stream = st;
+    return 0;
+}
+
+// Read state of first set up playback substream of card
+void readAlsaStream(const char *carddir, struct AlsaStream *stream) {
+    *stream = (struct AlsaStream){0};
+    DIR *dir = opendir(carddir);
+    if(!dir)    return;
+    struct dirent *de;
+    while(!stream->running && (de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if(strncmp(de->d_name, "pcm", 3) != 0 || de->d_name[len-1] != 'p')  continue;   // Playback devices
+        char pcmdir[512];
+        snprintf(pcmdir, sizeof(pcmdir), "%s/%s", carddir, de->d_name);
+        DIR *subdir = opendir(pcmdir);
+        if(!subdir)     continue;
+        struct dirent *sde;
+        while(!stream->running && (sde = readdir(subdir))) {
+            char filename[800];
+            if(strncmp(sde->d_name, "sub", 3) != 0)     continue;
+            snprintf(filename, sizeof(filename), "%s/%s/hw_params", pcmdir, sde->d_name);
+            readAlsaHwParams(filename, stream);
+        }
+        closedir(subdir);
+    }
+    closedir(dir);
+}
+
+// Setting of field to raw value
+cm6206_setting fieldValue(const char *name, unsigned value) {
+    const cm6206_field *f = cm6206_find_field(name);
+    assert(f);
+    return (cm6206_setting){f->reg, cm6206_field_mask(f), (uint16_t)(value << f->firstbit)};
+}
+
+// Settings of REG0 for stream. SPDIF Out carries the stream (DMA master) if its rate is supported,
+// IEC958 subframe formats are sent as non-audio. Returns number of settings
+int followSettings(const struct AlsaStream *stream, cm6206_setting *settings) {
+    static const struct { unsigned rate; unsigned value; } SPDIF_RATES[] = {
+        {44100, 0}, {48000, 2}, {32000, 3}, {96000, 6}  // Values of "SPDIF Out sample rate"
+    };
+    for(unsigned n=0; n<sizeof(SPDIF_RATES)/sizeof(SPDIF_RATES[0]); n++) {
+        if(SPDIF_RATES[n].rate != stream->rate)     continue;
+        settings[0] = fieldValue("SPDIF Out sample rate", SPDIF_RATES[n].value);
+        settings[1] = fieldValue("Non-audio", strncmp(stream->format, "IEC958", 6) == 0);
+        settings[2] = fieldValue("DMA Master", 1);
+        return 3;
+    }
+    settings[0] = fieldValue("DMA Master", 0);  // Rate not supported by SPDIF Out
+    return 1;
+}
+
+// Open inotify watch of ALSA device nodes. Returns descriptor or -1 if not available
+int followWatchOpen(void) {
+    int fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(fd >= 0 && inotify_add_watch(fd, ALSA_DEV_DIR, IN_OPEN|IN_CLOSE) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0 && cfg.verbose) { warn("Events of %s not available", ALSA_DEV_DIR); }
+    return fd;
+}
+
+// Read pending inotify events. Returns true if a playback PCM device of card was opened or closed
+bool followWatchRead(int fd, int card) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool pcm = false;
+    ssize_t len;
+    while((len = read(fd, buf, sizeof(buf))) > 0) {
+        for(char *p = buf; p < buf+len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            int evcard, evdev;
+            char dir;
+            if(ev->len && sscanf(ev->name, "pcmC%dD%d%c", &evcard, &evdev, &dir) == 3 && dir == 'p'
+               && (card < 0 || evcard == card))
+                pcm = true;
+        }
+    }
+    return pcm;
+}
+
+// Print stream state
+void printStream(const struct AlsaStream *stream) {
+    if(cfg.quiet)   return;
+    if(stream->running) { printf("Stream: %u Hz, %s, %u channels\n", stream->rate, stream->format, stream->channels); }
+    else                { printf("Stream: closed\n"); }
+}
+
+// Follow the ALSA playback stream until terminated. Registers are only written when the stream changes
+// rate or format, and then only if REG0 changes. Returns 0 when stopped, -1 on error
+int runFollow(cm6206_ctx **ctx) {
+    char carddir[256];
+    if(alsaCardDir(carddir, sizeof(carddir)) < 0) { warnx("No ALSA card of USB device found. Select it with --card"); return -1; }
+    int card = -1;
+    const char *base = strrchr(carddir, '/') ? strrchr(carddir, '/')+1 : carddir;
+    if(sscanf(base, "card%d", &card) != 1)  card = -1;  // Any card
+    if(!cfg.quiet) { printf("Following ALSA card %s\n", carddir); fflush(stdout); }
+
+    installStopHandler();
+    int watchfd = followWatchOpen();
+    struct AlsaStream applied = {0};
+    bool needApply = true;
+    int64_t fastUntil = 0;
+    while(!stopRequested) {
+        checkTraceRequest(*ctx);
+        struct AlsaStream stream;
+        readAlsaStream(carddir, &stream);
+        if(stream.running != applied.running || stream.rate != applied.rate
+           || strcmp(stream.format, applied.format) != 0) {
+            printStream(&stream);
+            applied = stream;
+            needApply = true;
+        }
+        if(needApply && *ctx && applied.running) {
+            cm6206_setting settings[3];
+            int count = followSettings(&applied, settings);
+            uint16_t prev[CM6206_NUM_REGS];
+            int res = cm6206_sync(*ctx, 1u << settings[0].reg);     // All settings are in REG0
+            if(res == 0) {
+                memcpy(prev, cm6206_shadow(*ctx, NULL), sizeof(prev));
+                res = cm6206_apply_trusted(*ctx, settings, count);
+            }
+            if(res < 0) {
+                deviceError(*ctx, res);
+                if(deviceLost(ctx) < 0)     return -1;
+                continue;
+            }
+            if(res > 0) {
+                printChanges(prev, cm6206_shadow(*ctx, NULL));
+                shmPublish(*ctx);
+            }
+            fflush(stdout);
+            needApply = false;
+        }
+
+        int timeout = (monotonicMs() < fastUntil) ? FOLLOW_FAST_MS : cfg.followMs;
+        struct pollfd fds[2] = {{.fd = watchfd, .events = POLLIN}, {.fd = hotplugFd, .events = POLLIN}};
+        if(poll(fds, 2, timeout) < 0)   continue;   // Interrupted by signal
+        if((fds[0].revents & POLLIN) && followWatchRead(watchfd, card))     fastUntil = monotonicMs() + FOLLOW_FAST_WINDOW_MS;
+        if(fds[1].revents & POLLIN) {
+            enum HotplugEvent event = hotplugRead();
+            handleHotplug(ctx, event);
+            if(event == HOTPLUG_ADDED)  needApply = true;   // Settings are applied again after reconnect
+        }
+    }
+    if(watchfd >= 0)    close(watchfd);
+    return 0;
+}
+
+
+//////// Daemon mode
+
+int64_t refreshedMs = 0;        // Time of last re-read of all registers (0 = never)
+uint64_t refreshCount = 0;      // Number of re-reads of all registers
+
+// Read a single request line from client. Returns length of line or -1 on error
+int daemonReadRequest(int fd, char *line, size_t size) {
+    size_t len = 0;
+    while(len < size-1) {
+        ssize_t n = read(fd, line+len, 1);
+        if(n < 0 && errno == EINTR)     continue;
+        if(n < 0)   return -1;
+        if(n == 0 || line[len] == '\n') break;
+        len++;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+// Serve a single client request. Output of the command (stdout and stderr) is sent to the client
+// followed by a status line "OK" or "ERROR". A failed transfer is handled as lost device
+void daemonServeClient(cm6206_ctx **ctx, int clientfd, const struct Config *basecfg) {
+    struct timeval tv = {1, 0};     // An idle or stalled client must not block the daemon
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char line[1024];
+    if(daemonReadRequest(clientfd, line, sizeof(line)) < 0)     return;
+
+    fflush(stdout); fflush(stderr);
+    int savedout = dup(STDOUT_FILENO);
+    int savederr = dup(STDERR_FILENO);
+    dup2(clientfd, STDOUT_FILENO);
+    dup2(clientfd, STDERR_FILENO);
+
+    int status = parseCommandLine(line, basecfg);
+    ioFailed = false;
+    if(status > 0 && !*ctx) {
+        warnx("USB device %s is not connected", devid.path);
+        status = -1;
+    } else if(status > 0) {
+        cm6206_invalidate(*ctx, CM6206_ALL_REGS);  // Registers used by the request are refreshed from the device
+        status = executeCommands(*ctx);
+        if(cfg.cacheMaxAgeMs)   cacheStoreContext(*ctx);
+    }
+    printf("%s\n", (status < 0) ? "ERROR" : "OK");
+
+    fflush(stdout); fflush(stderr);
+    dup2(savedout, STDOUT_FILENO);
+    dup2(savederr, STDERR_FILENO);
+    close(savedout);
+    close(savederr);
+    cfg = *basecfg;
+    if(ioFailed && *ctx)    deviceLost(ctx);    // Stalled device is closed until it is plugged in again
+}
+
+// Re-read all registers between requests (-W) and publish them
+void daemonRefresh(cm6206_ctx **ctx) {
+    if(!*ctx)   return;
+    refreshedMs = monotonicMs();
+    refreshCount++;
+    cm6206_invalidate(*ctx, CM6206_ALL_REGS);
+    if(syncRegisters(*ctx, CM6206_ALL_REGS) < 0) {
+        deviceLost(ctx);
+    } else if(cfg.cacheMaxAgeMs) {
+        cacheStoreContext(*ctx);
+    }
+    shmPublish(*ctx);
+}
+
+// Open Unix domain socket of daemon. Returns listening socket
+int daemonOpen(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(path) >= sizeof(addr.sun_path)) { errx(EXIT_FAILURE, "Socket path too long: %s", path); }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sockfd < 0) { err(EXIT_FAILURE, "socket"); }
+    unlink(path);
+    if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { err(EXIT_FAILURE, "bind: %s", path); }
+    if(listen(sockfd, 8) < 0) { err(EXIT_FAILURE, "listen: %s", path); }
+    if(!cfg.quiet) { printf("Serving requests on %s\n", path); fflush(stdout); }
+    return sockfd;
+}
+
+
+//////// Metrics exporter (--metrics)
+// Minimal HTTP server in the daemon loop for Prometheus scrapes. Scrapes are answered from the shadow
+// registers, which are re-read at most every -W interval (METRICS_REFRESH_MS without -W). Thus the
+// USB load does not depend on the number of scrapers.
+
+uint64_t metricsScrapes = 0;
+cm6206_buf metricsBuf = {0};    // Kept between scrapes to avoid reallocation
+
+// Open TCP socket listening on "[<address>:]<port>" (any address if not given). Returns listening socket
+int metricsOpen(const char *listenAddr) {
+    char host[256] = "";
+    const char *port = strrchr(listenAddr, ':');
+    if(port) {
+        size_t len = port - listenAddr;
+        if(len >= sizeof(host)) { errx(EXIT_FAILURE, "--metrics address too long: %s", listenAddr); }
+        memcpy(host, listenAddr, len);
+        host[len] = '\0';
+        if(host[0] == '[' && len >= 2 && host[len-1] == ']') {  // IPv6 address in brackets
+            memmove(host, host+1, len-2);
+            host[len-2] = '\0';
+        }
+        port++;
+    } else {
+        port = listenAddr;
+    }
+    struct addrinfo hints = {.ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *ai;
+    int res = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+    if(res != 0) { errx(EXIT_FAILURE, "--metrics %s: %s", listenAddr, gai_strerror(res)); }
+    int sockfd = socket(ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC, ai->ai_protocol);
+    if(sockfd < 0) { err(EXIT_FAILURE, "socket"); }
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(sockfd, ai->ai_addr, ai->ai_addrlen) < 0) { err(EXIT_FAILURE, "bind: %s", listenAddr); }
+    if(listen(sockfd, 8) < 0) { err(EXIT_FAILURE, "listen: %s", listenAddr); }
+    freeaddrinfo(ai);
+    if(!cfg.quiet) { printf("Serving metrics on %s\n", listenAddr); fflush(stdout); }
+    return sockfd;
+}
+
+// Read HTTP request up to the end of its header. Returns length or -1 on error
+int metricsReadRequest(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    while(len < size-1 && !strstr(buf, "\r\n\r\n") && !strstr(buf, "\n\n")) {
+        ssize_t n = read(fd, buf+len, size-1-len);
+        if(n < 0 && errno == EINTR)     continue;
+        if(n < 0)   return -1;
+        if(n == 0)  break;
+        len += n;
+        buf[len] = '\0';
+    }
+    return len;
+}
+
+// Render metrics of device context (NULL = not connected)
+void metricsRender(cm6206_ctx *ctx) {
+    static const uint16_t none[CM6206_NUM_REGS];
+    unsigned valid = 0;
+    const uint16_t *regs = ctx ? cm6206_shadow(ctx, &valid) : none;
+    cm6206_stats stats = runStats.device;   // Closed contexts and current context
+    if(ctx) {
+        cm6206_stats s;
+        cm6206_get_stats(ctx, &s);
+        statsAdd(&stats, &s);
+    }
+    metricsBuf.len = 0;
+    metricsBuf.failed = false;
+    cm6206_render_metrics(&metricsBuf, regs, valid, &stats);
+    cm6206_buf_printf(&metricsBuf, "# HELP cm6206_up Device is connected and all registers were read\n"
+        "# TYPE cm6206_up gauge\ncm6206_up %d\n", valid == CM6206_ALL_REGS);
+    if(refreshedMs) {
+        cm6206_buf_printf(&metricsBuf, "# HELP cm6206_sample_age_seconds Time since registers were re-read\n"
+            "# TYPE cm6206_sample_age_seconds gauge\ncm6206_sample_age_seconds %.3f\n", (monotonicMs() - refreshedMs)/1e3);
+    }
+    cm6206_buf_printf(&metricsBuf, "# HELP cm6206_refreshes_total Re-reads of all registers\n"
+        "# TYPE cm6206_refreshes_total counter\ncm6206_refreshes_total %llu\n", (unsigned long long)refreshCount);
+    cm6206_buf_printf(&metricsBuf, "# HELP cm6206_scrapes_total Served metrics requests\n"
+        "# TYPE cm6206_scrapes_total counter\ncm6206_scrapes_total %llu\n", (unsigned long long)metricsScrapes);
+}
+
+// Serve a single HTTP request. Registers are re-read first if they are older than the refresh interval
+// or incomplete (e.g. after a daemon request)
+void metricsServeClient(cm6206_ctx **ctx, int clientfd) {
+    struct timeval tv = {1, 0};     // A stalled client must not block the daemon
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char req[4096];
+    if(metricsReadRequest(clientfd, req, sizeof(req)) <= 0)     return;
+
+    char method[8], path[256];
+    if(sscanf(req, "%7s %255s", method, path) != 2)     return;
+    bool head = strcmp(method, "HEAD") == 0;
+    const char *status = "200 OK";
+    if(!head && strcmp(method, "GET") != 0)     status = "405 Method Not Allowed";
+    else if(strcmp(strtok(path, "?"), "/metrics") != 0)     status = "404 Not Found";
+    if(status[0] != '2') {
+        dprintf(clientfd, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+            status, strlen(status)+1, status);
+        return;
+    }
+
+    unsigned valid = 0;
+    if(*ctx)    cm6206_shadow(*ctx, &valid);
+    int maxAgeMs = cfg.watchMs ? cfg.watchMs : METRICS_REFRESH_MS;
+    if(*ctx && (valid != CM6206_ALL_REGS || monotonicMs() - refreshedMs >= maxAgeMs))   daemonRefresh(ctx);
+    metricsScrapes++;
+    metricsRender(*ctx);
+    dprintf(clientfd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", metricsBuf.len);
+    if(head)    metricsBuf.len = 0;
+    if(cm6206_buf_write(&metricsBuf, clientfd) == CM6206_ERR_NOMEM) { warnx("Metrics lost: out of memory"); }
+}
+
+
+//////// Serving loop (--daemon, --metrics)
+
+// Serve requests on Unix domain socket (--daemon) and metrics (--metrics) until terminated.
+// With -W the registers are refreshed in between
+void runDaemon(cm6206_ctx **ctx) {
+    const char *path = cfg.socketPath ? cfg.socketPath : DEFAULT_SOCKET_PATH;
+    int sockfd = cfg.daemon ? daemonOpen(path) : -1;
+    int metricsfd = cfg.metricsAddr ? metricsOpen(cfg.metricsAddr) : -1;
+
+    installStopHandler();
+    signal(SIGPIPE, SIG_IGN);   // Clients may disconnect early
+
+    struct Config basecfg = cfg;
+    basecfg.quiet = basecfg.verbose = false;    // Output options are given per request
+    struct pollfd fds[3] = {{.fd = sockfd, .events = POLLIN}, {.fd = hotplugFd, .events = POLLIN},
+                            {.fd = metricsfd, .events = POLLIN}};   // Negative descriptors are ignored by poll
+    int64_t next = monotonicMs() + cfg.watchMs;
+    while(!stopRequested) {
+        int timeout = -1;
+        if(cfg.watchMs) {
+            int64_t delay = next - monotonicMs();
+            if(delay <= 0) {
+                daemonRefresh(ctx);
+                next = (delay < -cfg.watchMs) ? monotonicMs() + cfg.watchMs : next + cfg.watchMs;  // Overrun. Do not try to catch up
+                continue;
+            }
+            timeout = delay;
+        }
+        if(poll(fds, 3, timeout) < 0) {
+            checkTraceRequest(*ctx);
+            if(errno == EINTR)  continue;
+            err(EXIT_FAILURE, "poll");
+        }
+        if(fds[1].revents & POLLIN) { handleHotplug(ctx, hotplugRead()); }
+        if(fds[2].revents & POLLIN) {
+            int clientfd = accept(metricsfd, NULL, NULL);
+            if(clientfd >= 0) {     // Failure (e.g. client gone) is not fatal for the daemon
+                metricsServeClient(ctx, clientfd);
+                close(clientfd);
+            }
+        }
+        if(!(fds[0].revents & POLLIN))  continue;
+        int clientfd = accept(sockfd, NULL, NULL);
+        if(clientfd < 0) {
+            if(errno == EINTR)  continue;
+            err(EXIT_FAILURE, "accept");
+        }
+        daemonServeClient(ctx, clientfd, &basecfg);
+        close(clientfd);
+        shmPublish(*ctx);
+    }
+    if(metricsfd >= 0)  close(metricsfd);
+    if(sockfd >= 0) {
+        close(sockfd);
+        unlink(path);
+    }
+}
+
+// Send command line arguments (except -S) as request to daemon and print the response
+int runClient(int argc, char* argv[]) {
+    char line[1024] = "";
+    for(int argn=1; argn<argc; argn++) {
+        if(strcmp(argv[argn], "-S")==0) { argn++; continue; }
+        bool quote = strpbrk(argv[argn], " \t") != NULL;
+        if(strlen(line) + strlen(argv[argn]) + 4 >= sizeof(line)) { errx(EXIT_FAILURE, "Request too long"); }
+        sprintf(line+strlen(line), quote ? "\"%s\" " : "%s ", argv[argn]);
+    }
+    strcat(line, "\n");
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(cfg.socketPath) >= sizeof(addr.sun_path)) { errx(EXIT_FAILURE, "Socket path too long: %s", cfg.socketPath); }
+    strcpy(addr.sun_path, cfg.socketPath);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sockfd < 0) { err(EXIT_FAILURE, "socket"); }
+    if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { err(EXIT_FAILURE, "connect: %s", cfg.socketPath); }
+    if(write(sockfd, line, strlen(line)) != (ssize_t)strlen(line)) { err(EXIT_FAILURE, "write: %s", cfg.socketPath); }
+    shutdown(sockfd, SHUT_WR);
+
+    // Copy response to stdout, holding back the last line (status)
+    char resp[4096];
+    size_t len = 0;
+    ssize_t n;
+    while((n = read(sockfd, resp+len, sizeof(resp)-len)) > 0) {
+        len += n;
+        char *lastnl = NULL;    // Output all complete lines except the last
+        for(char *p = resp+len-1; p >= resp && !lastnl; p--) { if(*p == '\n' && p != resp+len-1) lastnl = p; }
+        if(lastnl) {
+            size_t outlen = lastnl+1 - resp;
+            fwrite(resp, 1, outlen, stdout);
+            memmove(resp, resp+outlen, len-outlen);
+            len -= outlen;
+        }
+        if(len == sizeof(resp)) { fwrite(resp, 1, len, stdout); len = 0; }
+    }
+    close(sockfd);
+    return (len >= 2 && strncmp(resp, "OK", 2) == 0) ? 0 : EXIT_FAILURE;
+}
+
+
+// Open selected device and execute commands. Returns exit status
+int runDevice(void) {
+    cm6206_ctx *ctx;                    // Device context
+
+    runStats.startNs = monotonicNs();
+    if(cfg.stats)   atexit(printStats);
+    if(cfg.trace) {
+        struct sigaction sa = {.sa_handler = traceSignalHandler};   // Interrupts blocking calls (no SA_RESTART)
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+    selectDevice();
+    if((cfg.cacheMaxAgeMs && (ctx = cacheAnswer())) || (cfg.shmName && (ctx = shmAnswer()))) {
+        int status = (executeCommands(ctx) < 0) ? EXIT_FAILURE : 0;
+        closeDevice(ctx);
+        return status;
+    }
+
+    residentMode = cfg.watchMs || cfg.listen || cfg.daemon || cfg.metricsAddr || cfg.followMs;
+    int res = openDevice(&ctx);
+    if(res < 0)     openError(res);
+
+    if(!cfg.quiet) {
+        int64_t start = monotonicNs();
+        printUSBDeviceInfo(ctx);
+        runStats.stringsNs += monotonicNs() - start;
+    }
+
+    // Commands from command line are executed before any script
+    if(executeCommands(ctx) < 0)    return ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE;
+    if(cfg.scriptFile) {
+        executeScript(ctx, cfg.scriptFile);
+    }
+    if(cfg.cacheMaxAgeMs) {
+        cacheStoreContext(ctx);
+    }
+    if(residentMode) {
+        hotplugOpen();
+    }
+    if(cfg.shmName && (cfg.watchMs || cfg.daemon || cfg.metricsAddr || cfg.followMs)) {
+        shmOpen();
+        shmPublish(ctx);
+    }
+    if((cfg.watchMs || cfg.listen) && !cfg.daemon && !cfg.metricsAddr && runWatch(&ctx) < 0) {
+        shmClose();
+        return ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE;
+    }
+    if(cfg.followMs && runFollow(&ctx) < 0) {
+        shmClose();
+        return ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE;
+    }
+    if(cfg.daemon || cfg.metricsAddr) {
+        runDaemon(&ctx);
+    }
+    shmClose();
+
+    closeDevice(ctx);
+    hid_exit();
+    return 0;
+}
+
+
+//////// Benchmark
+// Measures the latency of the register I/O path. The device is opened as for other commands, so
+// the times include the selected options (--pipeline, -t, --retries) and the I/O watchdog.
+
+#define BENCH_OPERATIONS    3   // read, write, read all
+
+// Latency statistics of an operation
+struct BenchStats {
+    const char  *name;
+    int64_t     minNs, medianNs, p99Ns, maxNs;
+    double      opsPerSec;
+};
+
+int compareInt64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Compute statistics of samples. Samples are sorted in place
+struct BenchStats benchStats(const char *name, int64_t *samples, int count) {
+    int64_t total = 0;
+    for(int n=0; n<count; n++)  total += samples[n];
+    qsort(samples, count, sizeof(samples[0]), compareInt64);
+    int p99 = (count*99 + 99) / 100 - 1;    // Nearest rank
+    return (struct BenchStats){name, samples[0], samples[count/2], samples[p99], samples[count-1],
+        total ? count * 1e9 / total : 0};
+}
+
+void printBenchmark(const int64_t *phases, const char *const *phaseNames, int numPhases, const struct BenchStats *stats, int numStats) {
+    const char *backend = cfg.backend ? cfg.backend : "hidapi";
+    if(cfg.output == CM6206_FORMAT_JSON) {
+        printf("{\"backend\":\"%s\",\"iterations\":%d,\"register\":%d,\"pipeline\":%s,\"phases\":{", backend,
+            cfg.benchIterations, cfg.reg, cfg.pipeline ? "true" : "false");
+        for(int n=0; n<numPhases; n++)  printf("%s\"%s_us\":%.1f", n ? "," : "", phaseNames[n], phases[n]/1e3);
+        printf("},\"operations\":[");
+        for(int n=0; n<numStats; n++) {
+            printf("%s{\"name\":\"%s\",\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"ops_per_sec\":%.1f}",
+                n ? "," : "", stats[n].name, stats[n].minNs/1e3, stats[n].medianNs/1e3, stats[n].p99Ns/1e3,
+                stats[n].maxNs/1e3, stats[n].opsPerSec);
+        }
+        printf("]}\n");
+        return;
+    }
+    printf("Benchmark: %s backend, %d iterations, register %d, %s reads\n", backend, cfg.benchIterations, cfg.reg,
+        cfg.pipeline ? "pipelined" : "lockstep");
+    for(int n=0; n<numPhases; n++)  printf("%-12s %10.1f us\n", phaseNames[n], phases[n]/1e3);
+    printf("%-12s %10s %10s %10s %10s   (us) %10s\n", "Operation", "min", "median", "p99", "max", "ops/s");
+    for(int n=0; n<numStats; n++) {
+        printf("%-12s %10.1f %10.1f %10.1f %10.1f        %10.1f\n", stats[n].name, stats[n].minNs/1e3,
+            stats[n].medianNs/1e3, stats[n].p99Ns/1e3, stats[n].maxNs/1e3, stats[n].opsPerSec);
+    }
+}
+
+// Print median latencies of backends side by side
+void printBenchmarkComparison(struct BenchStats stats[][BENCH_OPERATIONS], int numBackends) {
+    printf("\n%-24s", "Median (us)");
+    for(int op=0; op<BENCH_OPERATIONS; op++)    printf(" %10s", stats[0][op].name);
+    printf("\n");
+    for(int n=0; n<numBackends; n++) {
+        printf("%-24.24s", cfg.backends[n]);
+        for(int op=0; op<BENCH_OPERATIONS; op++)    printf(" %10.1f", stats[n][op].medianNs/1e3);
+        printf("\n");
+    }
+}
+
+// Run latency benchmark on selected device with backend in cfg.backend. Returns exit status
+// A register value is only ever written back unchanged
+int runBackendBenchmark(struct BenchStats *result) {
+    static const char *const phaseNames[] = {"enumerate", "lookup", "open", "strings"};
+    int64_t phases[4];
+    int count = cfg.benchIterations;
+    int64_t *samples[3];
+    for(int n=0; n<3; n++) {
+        samples[n] = malloc(count * sizeof(int64_t));
+        if(!samples[n]) { err(EXIT_FAILURE, "malloc"); }
+    }
+
+    int64_t start = monotonicNs();
+    struct hid_device_info *hid_devs = hid_enumerate(CM6206_VENDOR_ID, CM6206_PRODUCT_ID);
+    phases[0] = monotonicNs() - start;
+    hid_free_enumeration(hid_devs);
+
+    start = monotonicNs();
+    selectDevice();
+    phases[1] = monotonicNs() - start;
+
+    cm6206_ctx *ctx;
+    start = monotonicNs();
+    int res = openDevice(&ctx);
+    phases[2] = monotonicNs() - start;
+    if(res < 0)     openError(res);
+    cm6206_set_timeout(ctx, cfg.timeoutMs, cfg.retries);
+    cm6206_set_pipeline(ctx, cfg.pipeline);
+
+    wchar_t strManuf[BUFLEN], strProduct[BUFLEN], strSerial[BUFLEN];
+    start = monotonicNs();
+    cm6206_get_strings(ctx, strManuf, strProduct, strSerial, BUFLEN);
+    phases[3] = monotonicNs() - start;
+
+    uint16_t value;
+    for(int n=0; n<count && res == 0; n++) {
+        start = monotonicNs();
+        res = cm6206_read(ctx, cfg.reg, &value);
+        samples[0][n] = monotonicNs() - start;
+    }
+    for(int n=0; n<count && res == 0; n++) {
+        start = monotonicNs();
+        res = cm6206_write(ctx, cfg.reg, value);
+        samples[1][n] = monotonicNs() - start;
+    }
+    for(int n=0; n<count && res == 0; n++) {
+        cm6206_invalidate(ctx, CM6206_ALL_REGS);
+        start = monotonicNs();
+        res = cm6206_sync(ctx, CM6206_ALL_REGS);
+        samples[2][n] = monotonicNs() - start;
+    }
+    int status = 0;
+    if(res < 0) {
+        deviceError(ctx, res);
+        status = ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE;
+    } else {
+        result[0] = benchStats("read", samples[0], count);
+        result[1] = benchStats("write", samples[1], count);
+        result[2] = benchStats("read all", samples[2], count);
+        printBenchmark(phases, phaseNames, 4, result, BENCH_OPERATIONS);
+    }
+    for(int n=0; n<3; n++)  free(samples[n]);
+    cm6206_close(ctx);
+    return status;
+}
+
+// Run latency benchmark with each backend given. Returns exit status
+int runBenchmark(void) {
+    struct BenchStats stats[MAX_BENCH_BACKENDS][BENCH_OPERATIONS];
+    int numBackends = cfg.numBackends ? cfg.numBackends : 1;
+    for(int n=0; n<numBackends; n++) {
+        cfg.backend = cfg.backends[n];
+        if(n && cfg.output != CM6206_FORMAT_JSON)   printf("\n");
+        int status = runBackendBenchmark(stats[n]);
+        if(status != 0)     return status;
+    }
+    if(numBackends > 1 && cfg.output != CM6206_FORMAT_JSON)     printBenchmarkComparison(stats, numBackends);
+    hid_exit();
+    return 0;
+}
+
+
+//////// Stress test
+// Verified writes (write and read back) of the selected register at a target rate from several worker
+// threads for a set duration. Each worker has its own device context. By default the value read is
+// written back unchanged. With -w the register alternates between its value and the value of -w
+// (bits of -m), and the value is restored at the end. Latencies are kept in histograms, so memory
+// does not grow with the duration of a soak test.
+
+#define STRESS_INTERVAL_MS  1000    // Reporting interval
+#define STRESS_MAX_ERRORS   100     // A worker stops after this number of consecutive failures
+#define HIST_SUB_BITS       3       // Sub buckets per power of two (2^bits)
+#define HIST_BUCKETS        (64 << HIST_SUB_BITS)
+
+// Log-linear histogram of latencies. Percentiles are accurate to 1/2^HIST_SUB_BITS
+struct LatencyHist {
+    uint64_t    count;
+    int64_t     minNs, maxNs;
+    uint32_t    buckets[HIST_BUCKETS];
+};
+
+unsigned histBucket(int64_t ns) {
+    if(ns < (1 << HIST_SUB_BITS))   return ns < 0 ? 0 : ns;
+    int log = 63 - __builtin_clzll(ns);
+    return (log << HIST_SUB_BITS) | ((ns >> (log - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+void histAdd(struct LatencyHist *h, int64_t ns) {
+    if(!h->count || ns < h->minNs)  h->minNs = ns;
+    if(!h->count || ns > h->maxNs)  h->maxNs = ns;
+    h->count++;
+    h->buckets[histBucket(ns)]++;
+}
+
+void histMerge(struct LatencyHist *h, const struct LatencyHist *other) {
+    if(!other->count)   return;
+    if(!h->count || other->minNs < h->minNs)    h->minNs = other->minNs;
+    if(!h->count || other->maxNs > h->maxNs)    h->maxNs = other->maxNs;
+    h->count += other->count;
+    for(int n=0; n<HIST_BUCKETS; n++)   h->buckets[n] += other->buckets[n];
+}
+
+// Latency of percentile (nearest rank, middle of bucket). 0 if empty
+int64_t histPercentile(const struct LatencyHist *h, int pct) {
+    uint64_t rank = (h->count*pct + 99) / 100, seen = 0;
+    for(unsigned b=0; b<HIST_BUCKETS && h->count; b++) {
+        seen += h->buckets[b];
+        if(seen < rank || !seen)    continue;
+        if(b < (1 << HIST_SUB_BITS))    return b;
+        int log = b >> HIST_SUB_BITS;
+        int64_t width = (int64_t)1 << (log - HIST_SUB_BITS);
+        int64_t value = ((int64_t)((1 << HIST_SUB_BITS) | (b & ((1 << HIST_SUB_BITS) - 1))) << (log - HIST_SUB_BITS)) + width/2;
+        return (value < h->minNs) ? h->minNs : (value > h->maxNs) ? h->maxNs : value;
+    }
+    return 0;
+}
+
+// Results of verified writes
+struct StressCounts {
+    uint64_t    cycles;         // Verified writes (write and read back)
+    uint64_t    mismatches;     // Read back value differs from value written
+    uint64_t    timeouts;       // No response after all retries
+    uint64_t    readErrors;     // CM6206_ERR_READ
+    uint64_t    reportErrors;   // CM6206_ERR_REPORT
+    uint64_t    writeErrors;
+    uint64_t    otherErrors;
+};
+
+// State shared by stress workers and the reporting thread. Protected by lock
+struct StressState {
+    pthread_mutex_t lock;
+    int64_t     endNs;          // End of test (monotonic clock)
+    struct StressCounts interval, total;
+    struct LatencyHist intervalHist, totalHist;
+    cm6206_stats device;        // Counters of closed worker contexts
+    int         failedOpens;
+} stress = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void stressCountsAdd(struct StressCounts *to, const struct StressCounts *c) {
+    to->cycles += c->cycles;
+    to->mismatches += c->mismatches;
+    to->timeouts += c->timeouts;
+    to->readErrors += c->readErrors;
+    to->reportErrors += c->reportErrors;
+    to->writeErrors += c->writeErrors;
+    to->otherErrors += c->otherErrors;
+}
+
+uint64_t stressFailures(const struct StressCounts *c) {
+    return c->mismatches + c->timeouts + c->readErrors + c->reportErrors + c->writeErrors + c->otherErrors;
+}
+
+// Record result of verified write. Returns true if it succeeded
+bool stressRecord(int res, bool mismatch, int64_t latencyNs) {
+    struct StressCounts c = {0};
+    if(res == CM6206_ERR_TIMEOUT)       c.timeouts = 1;
+    else if(res == CM6206_ERR_READ)     c.readErrors = 1;
+    else if(res == CM6206_ERR_REPORT)   c.reportErrors = 1;
+    else if(res == CM6206_ERR_WRITE)    c.writeErrors = 1;
+    else if(res < 0)                    c.otherErrors = 1;
+    else if(mismatch)                   c.mismatches = 1;
+    else                                c.cycles = 1;
+    pthread_mutex_lock(&stress.lock);
+    stressCountsAdd(&stress.interval, &c);
+    if(c.cycles)    histAdd(&stress.intervalHist, latencyNs);
+    pthread_mutex_unlock(&stress.lock);
+    return c.cycles;
+}
+
+// Stress worker thread. Writes at cfg.stressRate / cfg.stressWorkers per second
+void *stressWorker(void *arg) {
+    (void)arg;
+    cm6206_ctx *ctx;
+    int res = cm6206_open_backend(cfg.backend, devidValid ? devid.path : cfg.devicePath, &ctx);
+    if(res < 0) {
+        warnx("Could not open USB device %s (%s)", devidValid ? devid.path : cfg.devicePath, cm6206_strerror(res));
+        pthread_mutex_lock(&stress.lock);
+        stress.failedOpens++;
+        pthread_mutex_unlock(&stress.lock);
+        return NULL;
+    }
+    cm6206_set_timeout(ctx, cfg.timeoutMs, cfg.retries);
+    uint16_t orig;
+    res = cm6206_read(ctx, cfg.reg, &orig);
+    if(res < 0) {
+        warnx("%s", cm6206_error(ctx));
+        stressRecord(res, false, 0);
+    }
+    uint16_t values[2] = {orig, (orig & ~cfg.mask) | (cfg.writeVal & cfg.mask)};
+    int64_t periodNs = cfg.stressRate ? (int64_t)1000000000 * cfg.stressWorkers / cfg.stressRate : 0;
+    int64_t next = monotonicNs();
+    int failures = 0;
+    for(uint64_t n=0; res == 0 && !stopRequested && failures < STRESS_MAX_ERRORS; n++) {
+        if(periodNs) {
+            next += periodNs;
+            struct timespec ts = {next/1000000000, next%1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        if(monotonicNs() >= stress.endNs)   break;
+        uint16_t value = values[cfg.cmdWrite ? n % 2 : 0], readback = 0;
+        int64_t start = monotonicNs();
+        int r = cm6206_write(ctx, cfg.reg, value);
+        if(r == 0)  r = cm6206_read(ctx, cfg.reg, &readback);
+        failures = stressRecord(r, readback != value, monotonicNs() - start) ? 0 : failures + 1;
+    }
+    if(failures >= STRESS_MAX_ERRORS)   warnx("Worker stopped after %d failures: %s", failures, cm6206_error(ctx));
+    if(res == 0 && cfg.cmdWrite && cm6206_write(ctx, cfg.reg, orig) < 0)    warnx("%s", cm6206_error(ctx));
+
+    cm6206_stats s;
+    cm6206_get_stats(ctx, &s);
+    pthread_mutex_lock(&stress.lock);
+    stress.device.retries += s.retries;
+    stress.device.timeouts += s.timeouts;
+    stress.device.reportsWritten += s.reportsWritten;
+    stress.device.reportsRead += s.reportsRead;
+    pthread_mutex_unlock(&stress.lock);
+    cm6206_close(ctx);
+    return NULL;
+}
+
+// Get results of current interval and add them to totals
+void stressTakeInterval(struct StressCounts *c, struct LatencyHist *h) {
+    pthread_mutex_lock(&stress.lock);
+    *c = stress.interval;
+    *h = stress.intervalHist;
+    memset(&stress.interval, 0, sizeof(stress.interval));
+    memset(&stress.intervalHist, 0, sizeof(stress.intervalHist));
+    stressCountsAdd(&stress.total, c);
+    histMerge(&stress.totalHist, h);
+    pthread_mutex_unlock(&stress.lock);
+}
+
+// Print interval of stress test. Medians of first and last interval are kept for the drift
+void printStressInterval(int64_t elapsedNs, int64_t lengthNs, int64_t *firstMedianNs, int64_t *lastMedianNs) {
+    struct StressCounts c;
+    struct LatencyHist h;
+    stressTakeInterval(&c, &h);
+
+    int64_t median = histPercentile(&h, 50);
+    if(h.count) {
+        if(!*firstMedianNs)     *firstMedianNs = median;
+        *lastMedianNs = median;
+    }
+    double rate = lengthNs ? c.cycles * 1e9 / lengthNs : 0;
+    if(cfg.output == CM6206_FORMAT_JSON) {
+        printf("{\"time_s\":%.1f,\"writes_per_sec\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+            "\"mismatches\":%llu,\"timeouts\":%llu,\"errors\":%llu}\n", elapsedNs/1e9, rate, median/1e3,
+            histPercentile(&h, 99)/1e3, h.maxNs/1e3, (unsigned long long)c.mismatches, (unsigned long long)c.timeouts,
+            (unsigned long long)(stressFailures(&c) - c.mismatches - c.timeouts));
+    } else {
+        printf("%8.1f %10.1f %10.1f %10.1f %10.1f %10llu %10llu %10llu\n", elapsedNs/1e9, rate, median/1e3,
+            histPercentile(&h, 99)/1e3, h.maxNs/1e3, (unsigned long long)c.mismatches, (unsigned long long)c.timeouts,
+            (unsigned long long)(stressFailures(&c) - c.mismatches - c.timeouts));
+    }
+    fflush(stdout);
+}
+
+// Print totals of stress test
+void printStressSummary(int64_t elapsedNs, int64_t firstMedianNs, int64_t lastMedianNs) {
+    const struct StressCounts *c = &stress.total;
+    const struct LatencyHist *h = &stress.totalHist;
+    double rate = elapsedNs ? c->cycles * 1e9 / elapsedNs : 0;
+    double drift = firstMedianNs ? (lastMedianNs - firstMedianNs) * 100.0 / firstMedianNs : 0;
+    if(cfg.output == CM6206_FORMAT_JSON) {
+        printf("{\"summary\":{\"duration_s\":%.1f,\"verified_writes\":%llu,\"writes_per_sec\":%.1f,\"mismatches\":%llu,\"timeouts\":%llu,"
+            "\"read_errors\":%llu,\"report_errors\":%llu,\"write_errors\":%llu,\"other_errors\":%llu,\"retries\":%llu,"
+            "\"lost_responses\":%llu,\"min_us\":%.1f,\"median_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"drift_pct\":%.1f}}\n",
+            elapsedNs/1e9, (unsigned long long)c->cycles, rate, (unsigned long long)c->mismatches,
+            (unsigned long long)c->timeouts, (unsigned long long)c->readErrors, (unsigned long long)c->reportErrors,
+            (unsigned long long)c->writeErrors, (unsigned long long)c->otherErrors, (unsigned long long)stress.device.retries,
+            (unsigned long long)stress.device.timeouts, h->minNs/1e3, histPercentile(h, 50)/1e3, histPercentile(h, 99)/1e3,
+            h->maxNs/1e3, drift);
+        return;
+    }
+    printf("\nVerified writes %10llu (%.1f/s)\n", (unsigned long long)c->cycles, rate);
+    printf("Mismatches      %10llu\n", (unsigned long long)c->mismatches);
+    printf("Timeouts        %10llu (no response after retries)\n", (unsigned long long)c->timeouts);
+    printf("Read errors     %10llu\n", (unsigned long long)c->readErrors);
+    printf("Report errors   %10llu (no register data in input report)\n", (unsigned long long)c->reportErrors);
+    printf("Write errors    %10llu\n", (unsigned long long)c->writeErrors);
+    printf("Other errors    %10llu\n", (unsigned long long)c->otherErrors);
+    printf("Retries         %10llu\n", (unsigned long long)stress.device.retries);
+    printf("Lost responses  %10llu (not received within deadline)\n", (unsigned long long)stress.device.timeouts);
+    printf("Latency (us)    min %.1f, median %.1f, p99 %.1f, max %.1f\n", h->minNs/1e3, histPercentile(h, 50)/1e3,
+        histPercentile(h, 99)/1e3, h->maxNs/1e3);
+    printf("Drift           %+.1f %% (median of last interval to first)\n", drift);
+}
+
+// Run stress test on selected device. Returns exit status (failure if any write failed or mismatched)
+int runStress(void) {
+    bool emulated = cfg.backend && strncmp(cfg.backend, "emu", 3) == 0;
+    if(cfg.cmdWrite && cfg.stressWorkers > 1 && !emulated) {
+        errx(EXIT_FAILURE, "Alternating writes (-w) of several workers on one device can not be verified. Use --concurrency 1");
+    }
+    selectDevice();
+    installStopHandler();
+    int64_t start = monotonicNs();
+    stress.endNs = start + (int64_t)cfg.stressSeconds * 1000000000;
+
+    if(cfg.output != CM6206_FORMAT_JSON) {
+        printf("Stress test: %s backend, register %d, %d workers, %d s, ", cfg.backend ? cfg.backend : "hidapi", cfg.reg,
+            cfg.stressWorkers, cfg.stressSeconds);
+        if(cfg.stressRate)  printf("%d writes/s\n", cfg.stressRate);
+        else                printf("unlimited rate\n");
+        printf("%8s %10s %10s %10s %10s %10s %10s %10s\n", "time (s)", "writes/s", "median us", "p99 us", "max us",
+            "mismatch", "timeouts", "errors");
+        fflush(stdout);
+    }
+    pthread_t threads[MAX_STRESS_WORKERS];
+    for(int n=0; n<cfg.stressWorkers; n++) {
+        if(pthread_create(&threads[n], NULL, stressWorker, NULL) != 0) { errx(EXIT_FAILURE, "pthread_create failed"); }
+    }
+
+    int64_t firstMedian = 0, lastMedian = 0, intervalStart = start;
+    while(!stopRequested) {
+        int64_t now = monotonicNs();
+        if(now >= stress.endNs)     break;
+        int64_t wait = intervalStart + STRESS_INTERVAL_MS*1000000LL - now;
+        if(wait > 0) {
+            struct timespec ts = {wait/1000000000, wait%1000000000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        printStressInterval(now - start, now - intervalStart, &firstMedian, &lastMedian);
+        intervalStart = now;
+    }
+    for(int n=0; n<cfg.stressWorkers; n++)  pthread_join(threads[n], NULL);
+    int64_t now = monotonicNs();
+    if(now - intervalStart >= STRESS_INTERVAL_MS*1000000LL/10) {    // Partial interval of at least 10%
+        printStressInterval(now - start, now - intervalStart, &firstMedian, &lastMedian);
+    } else {
+        struct StressCounts c;
+        struct LatencyHist h;
+        stressTakeInterval(&c, &h);     // Too short to be reported on its own
+    }
+    printStressSummary(now - start, firstMedian, lastMedian);
+    if(stress.failedOpens == cfg.stressWorkers)     return EXIT_FAILURE;
+    if(stressFailures(&stress.total) || stress.failedOpens)     return stress.total.timeouts ? EXIT_TIMEOUT : EXIT_FAILURE;
+    return 0;
+}
+
+
+//////// Multiple devices
+
+// Resolve device selection into list of device paths. Selection is "all" or a comma separated list
+// of device paths or serial numbers. Returns number of devices
+// Devices are resolved through sysfs. HID enumeration is only done for entries not found there
+int resolveDevices(const char *selection, char *paths[], int maxpaths) {
+    int count = 0;
+    struct hid_device_info *hid_devs = NULL;
+    bool enumerated = false;
+    if(strcmp(selection, "all") == 0) {
+        struct DeviceId ids[MAX_DEVICES];
+        int num = listDevices(ids, MAX_DEVICES);
+        for(int n=0; n<num && count < maxpaths; n++) {
+            paths[count++] = strdup(ids[n].path);
+        }
+        if(num < 0)     hid_devs = enumerateDevices();  // No sysfs
+        for(struct hid_device_info *hd = hid_devs; hd && count < maxpaths; hd = hd->next) {
+            paths[count++] = strdup(hd->path);
+        }
+    } else {
+        char *list = strdup(selection);
+        for(char *entry = strtok(list, ","); entry && count < maxpaths; entry = strtok(NULL, ",")) {
+            const char *path = entry;   // Unknown entries are tried as path
+            struct DeviceId id;
+            if(lookupDeviceId(entry, &id) == 0) {
+                paths[count++] = strdup(id.path);
+                continue;
+            }
+            if(!enumerated) {
+                hid_devs = enumerateDevices();
+                enumerated = true;
+            }
+            for(struct hid_device_info *hd = hid_devs; hd; hd = hd->next) {
+                char serial[128] = "";
+                if(hd->serial_number) { wcstombs(serial, hd->serial_number, sizeof(serial)-1); }
+                if(strcmp(hd->path, entry) == 0 || strcmp(serial, entry) == 0) {
+                    path = hd->path;
+                    break;
+                }
+            }
+            paths[count++] = strdup(path);
+        }
+        free(list);
+    }
+    hid_free_enumeration(hid_devs);
+    return count;
+}
+
+// Device polled by watchDevices()
+struct WatchDevice {
+    char        *path;
+    cm6206_ctx  *ctx;               // NULL = failed
+    uint16_t    regs[CM6206_NUM_REGS];  // Registers of current poll
+    uint16_t    prev[CM6206_NUM_REGS];
+    bool        havePrev;
+    int         error;              // First error of current poll
+};
+
+// Completion of register read of watched device
+void watchCompletion(cm6206_ctx *ctx, void *user, int result, uint8_t regnum, uint16_t value) {
+    (void)ctx;
+    struct WatchDevice *dev = user;
+    if(result < 0 && !dev->error)   dev->error = result;
+    dev->regs[regnum] = value;
+}
+
+// Watch all selected devices from one thread. The registers of all devices are read concurrently
+// with the event loop of the library, one read in flight per device. A failed device is dropped
+// Returns exit status, or -1 if the backend does not support the event loop
+int watchDevices(char *paths[], int count) {
+    struct WatchDevice devs[MAX_DEVICES] = {0};
+    residentMode = true;    // A stalled device is dropped
+    cm6206_loop *loop = cm6206_loop_create();
+    if(!loop) { err(EXIT_FAILURE, "cm6206_loop_create"); }
+    runStats.startNs = monotonicNs();
+    if(cfg.stats)   atexit(printStats);
+
+    for(int n=0; n<count; n++) {    // Open all devices before any output
+        devs[n].path = paths[n];
+        cfg.devicePath = paths[n];
+        selectDevice();
+        devs[n].error = openDevice(&devs[n].ctx);
+        if(devs[n].error == 0)  devs[n].error = cm6206_loop_add(loop, devs[n].ctx);
+        if(devs[n].error == CM6206_ERR_BACKEND) {   // Not supported by backend. Use worker processes
+            for(int k=0; k<=n; k++) {
+                if(devs[k].ctx)     closeDevice(devs[k].ctx);
+            }
+            cm6206_loop_destroy(loop);
+            return -1;
+        }
+    }
+
+    int failures = 0, active = 0;
+    for(int n=0; n<count; n++) {
+        struct WatchDevice *dev = &devs[n];
+        printf("== Device %s ==\n", dev->path);
+        fflush(stdout);     // Keep order with errors
+        int res = dev->error;
+        if(!dev->ctx) {
+            warnx("Could not open USB device %s (%s)", dev->path, cm6206_strerror(res));
+        } else if(res < 0) {
+            warnx("%s", cm6206_error(dev->ctx));
+        } else {
+            cfg.devicePath = dev->path;
+            selectDevice();
+            if(!cfg.quiet)  printUSBDeviceInfo(dev->ctx);
+            res = executeCommands(dev->ctx);
+        }
+        if(res < 0) {
+            if(dev->ctx)    closeDevice(dev->ctx);
+            dev->ctx = NULL;
+            failures++;
+            continue;
+        }
+        active++;
+    }
+
+    installStopHandler();
+    int64_t next = monotonicMs();
+    while(!stopRequested && active) {
+        unsigned outstanding = 0;
+        for(int n=0; n<count; n++) {
+            if(!devs[n].ctx)    continue;
+            devs[n].error = 0;
+            for(int r=0; r<CM6206_NUM_REGS; r++) {
+                cm6206_submit_read(devs[n].ctx, r, watchCompletion, &devs[n]);
+            }
+            outstanding += CM6206_NUM_REGS;
+        }
+        while(!stopRequested && outstanding) {
+            int res = cm6206_loop_run(loop, -1);
+            if(res < 0) { err(EXIT_FAILURE, "cm6206_loop_run"); }
+            outstanding -= res;
+        }
+        if(stopRequested)   break;
+        for(int n=0; n<count; n++) {
+            struct WatchDevice *dev = &devs[n];
+            if(!dev->ctx)   continue;
+            if(dev->error) {
+                warnx("%s: %s", dev->path, cm6206_error(dev->ctx));
+                if(cfg.trace)   dumpTrace(dev->ctx, STDERR_FILENO);
+                if(dev->error == CM6206_ERR_TIMEOUT)    ioTimeout = true;
+                closeDevice(dev->ctx);
+                dev->ctx = NULL;
+                failures++;
+                active--;
+                continue;
+            }
+            if(dev->havePrev && memcmp(dev->prev, dev->regs, sizeof(dev->prev)) != 0) {
+                printf("== Device %s ==\n", dev->path);
+                printChanges(dev->prev, dev->regs);
+            }
+            memcpy(dev->prev, dev->regs, sizeof(dev->prev));
+            dev->havePrev = true;
+        }
+        fflush(stdout);
+        next += cfg.watchMs;
+        int64_t delay = next - monotonicMs();
+        if(delay <= 0) {
+            next = monotonicMs();   // Overrun. Do not try to catch up
+        } else {
+            struct timespec ts = {delay/1000, (delay%1000)*1000000};
+            nanosleep(&ts, NULL);   // Interrupted by stop signal
+        }
+    }
+
+    for(int n=0; n<count; n++) {
+        if(devs[n].ctx)     closeDevice(devs[n].ctx);
+    }
+    cm6206_loop_destroy(loop);
+    if(failures) { warnx("Command failed on %d of %d devices", failures, count); }
+    if(failures)    return ioTimeout ? EXIT_TIMEOUT : EXIT_FAILURE;
+    return 0;
+}
+
+// Run the command on all selected devices in parallel with one worker process per device
+// Output is printed grouped per device. Returns exit status (failure if any device failed)
+int runMultipleDevices(void) {
+    char *paths[MAX_DEVICES];
+    int count = resolveDevices(cfg.devicePath, paths, MAX_DEVICES);
+    if(count == 0) { errx(EXIT_FAILURE, "Found no USB devices with ID %04x:%04x", CM6206_VENDOR_ID, CM6206_PRODUCT_ID); }
+    if(cfg.watchMs && !cfg.listen && !cfg.scriptFile) {
+        int status = watchDevices(paths, count);
+        if(status >= 0)     return status;
+    }
+    hid_exit();     // Each worker initializes its own USB context
+
+    pid_t pids[MAX_DEVICES];
+    FILE *outputs[MAX_DEVICES];
+    fflush(stdout); fflush(stderr);
+    for(int n=0; n<count; n++) {
+        outputs[n] = tmpfile();
+        if(!outputs[n]) { err(EXIT_FAILURE, "tmpfile"); }
+        pids[n] = fork();
+        if(pids[n] < 0) { err(EXIT_FAILURE, "fork"); }
+        if(pids[n] == 0) {  // Worker
+            dup2(fileno(outputs[n]), STDOUT_FILENO);
+            dup2(fileno(outputs[n]), STDERR_FILENO);
+            cfg.devicePath = paths[n];
+            exit(runDevice());
+        }
+    }
+
+    int failures = 0;
+    for(int n=0; n<count; n++) {
+        int status;
+        if(waitpid(pids[n], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failures++;
+        printf("== Device %s ==\n", paths[n]);
+        rewind(outputs[n]);
+        char buf[4096];
+        size_t len;
+        while((len = fread(buf, 1, sizeof(buf), outputs[n])) > 0)   fwrite(buf, 1, len, stdout);
+        fclose(outputs[n]);
+        free(paths[n]);
+    }
+    if(failures) { warnx("Command failed on %d of %d devices", failures, count); }
+    return failures ? EXIT_FAILURE : 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    if(parseArgumentsToConfig(argc, argv) < 0)  exit(EXIT_FAILURE);
+
+    if(cfg.socketPath && !cfg.daemon) {     // Thin client to daemon
+        return runClient(argc, argv);
+    }
+
+    if(cfg.devicePath && (strcmp(cfg.devicePath, "all") == 0 || strchr(cfg.devicePath, ','))) {
+        if(cfg.daemon) { errx(EXIT_FAILURE, "--daemon supports only a single device"); }
+        if(cfg.shmName && cfg.watchMs) { errx(EXIT_FAILURE, "--shm supports only a single device"); }
+        if(cfg.metricsAddr) { errx(EXIT_FAILURE, "--metrics supports only a single device"); }
+        if(cfg.gpioSteps && strcmp(cfg.gpioSteps, "-") == 0) { errx(EXIT_FAILURE, "--gpio - supports only a single device"); }
+        if(cfg.scriptFile && strcmp(cfg.scriptFile, "-") == 0) { errx(EXIT_FAILURE, "-f - supports only a single device"); }
+        if(cfg.followMs) { errx(EXIT_FAILURE, "--follow supports only a single device"); }
+        return runMultipleDevices();
+    }
+    if(cfg.metricsAddr && cfg.listen) { errx(EXIT_FAILURE, "--metrics can not be combined with -L"); }
+    if(cfg.followMs && (cfg.watchMs || cfg.listen || cfg.daemon || cfg.metricsAddr)) {
+        errx(EXIT_FAILURE, "--follow can not be combined with -W, -L, --daemon or --metrics");
+    }
+    if(cfg.benchIterations) {
+        return runBenchmark();
+    }
+    if(cfg.stressSeconds) {
+        return runStress();
+    }
+    return runDevice();
+}